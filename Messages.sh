@@ -1,2 +1,4 @@
 #!/bin/sh
+$EXTRACTRC conf/*.ui conf/*.kcfg >> rc.cpp
 $XGETTEXT *.cpp -o $podir/okular_mupdf.pot
+rm -f rc.cpp
@@ -0,0 +1,77 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "displaylistcache.hpp"
+
+namespace QMuPDF
+{
+
+// Lists hold on to the images and fonts of their page, so only the pages
+// around the visible ones in a few configurations are kept
+static const size_t s_maxLists = 32;
+
+DisplayListCache::DisplayListCache() = default;
+
+DisplayListCache::~DisplayListCache()
+{
+    Q_ASSERT(m_entries.empty());
+}
+
+void DisplayListCache::setConfiguration(const QByteArray &configuration)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_configuration = configuration;
+}
+
+fz_display_list *DisplayListCache::find(fz_context *ctx, int page)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        if (it->page == page && it->configuration == m_configuration) {
+            m_entries.splice(m_entries.begin(), m_entries, it);
+            return fz_keep_display_list(ctx, it->list);
+        }
+    }
+
+    return nullptr;
+}
+
+void DisplayListCache::insert(fz_context *ctx, int page, fz_display_list *list)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        if (it->page == page && it->configuration == m_configuration) {
+            fz_drop_display_list(ctx, it->list);
+            m_entries.erase(it);
+            break;
+        }
+    }
+
+    m_entries.push_front({ m_configuration, page, fz_keep_display_list(ctx, list) });
+
+    while (m_entries.size() > s_maxLists) {
+        fz_drop_display_list(ctx, m_entries.back().list);
+        m_entries.pop_back();
+    }
+}
+
+void DisplayListCache::clear(fz_context *ctx)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (const Entry &entry : m_entries) {
+        fz_drop_display_list(ctx, entry.list);
+    }
+
+    m_entries.clear();
+}
+
+} // namespace QMuPDF
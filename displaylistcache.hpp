@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_DISPLAYLISTCACHE_HPP
+#define QMUPDF_DISPLAYLISTCACHE_HPP
+
+extern "C" {
+#include <mupdf/fitz.h>
+}
+
+#include <QByteArray>
+
+#include <list>
+#include <mutex>
+
+namespace QMuPDF
+{
+
+// Display lists of the pages of a document with layers, kept per layer
+// configuration. Which layers are shown is decided while interpreting a
+// page, so a list only applies to the configuration it was recorded in,
+// but switching back to one rasterizes its pages without interpreting
+// them again. Can be used from several threads.
+class DisplayListCache
+{
+public:
+    DisplayListCache();
+    ~DisplayListCache();
+
+    // Identifies the layers shown from now on, see Document::layerState()
+    void setConfiguration(const QByteArray &configuration);
+    // Returns a new reference to the list of page in the current
+    // configuration, or null if there is none
+    fz_display_list *find(fz_context *ctx, int page);
+    // Keeps a reference to list as the one of page in the current
+    // configuration
+    void insert(fz_context *ctx, int page, fz_display_list *list);
+    // Has to be called before the contexts of the document are dropped
+    void clear(fz_context *ctx);
+
+private:
+    Q_DISABLE_COPY(DisplayListCache)
+    struct Entry {
+        QByteArray configuration;
+        int page;
+        fz_display_list *list;
+    };
+
+    std::mutex m_mutex;
+    QByteArray m_configuration;
+    // Most recently used first
+    std::list<Entry> m_entries;
+};
+
+} // namespace QMuPDF
+
+#endif
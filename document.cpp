@@ -8,7 +8,10 @@
  ***************************************************************************/
 
 #include "document.hpp"
+#include "displaylistcache.hpp"
+#include "imagecache.hpp"
 #include "page.hpp"
+#include "progressivestream.hpp"
 
 extern "C" {
 #include <mupdf/pdf.h>
@@ -17,17 +20,61 @@ extern "C" {
 #include <QFile>
 
 #include <cstring>
+#include <mutex>
+
+#include <sys/stat.h>
 
 namespace QMuPDF
 {
 
 QRectF convert_fz_rect(const fz_rect &rect, const QSizeF &dpi);
 
+// Bytes compared at a time between the revisions of a file
+static const qint64 s_compareBlock = 1024 * 1024;
+
+static void lockMutex(void *user, int lock)
+{
+    static_cast<std::mutex *>(user)[lock].lock();
+}
+
+static void unlockMutex(void *user, int lock)
+{
+    static_cast<std::mutex *>(user)[lock].unlock();
+}
+
+// The documents' contexts are cloned from this one, so they share a single
+// bounded store, glyph cache and font context within the process.
+struct BaseContext {
+    explicit BaseContext(size_t storeSize)
+        : locks{mutexes, lockMutex, unlockMutex}
+        , ctx(fz_new_context(nullptr, &locks, storeSize))
+    {
+        if (ctx) {
+            fz_register_document_handlers(ctx);
+        }
+    }
+    ~BaseContext()
+    {
+        fz_drop_context(ctx);
+    }
+
+    std::mutex mutexes[FZ_LOCK_MAX];
+    fz_locks_context locks;
+    fz_context *ctx;
+};
+
+// The first document decides the size of the store
+static fz_context *baseContext(size_t storeSize)
+{
+    static BaseContext base(storeSize);
+    return base.ctx;
+}
+
 struct Document::Data {
-    Data()
-        : ctx(fz_new_context(nullptr, nullptr, FZ_STORE_DEFAULT))
+    explicit Data(size_t storeSize)
+        : ctx(fz_clone_context(baseContext(storeSize)))
         , mdoc(nullptr), stream(nullptr), pageCount(0), info(nullptr)
-        , pageMode(Document::UseNone), locked(false) { }
+        , pageMode(Document::UseNone), layerCount(0), locked(false), progressive(false) { }
 
     fz_context *ctx;
     fz_document *mdoc;
@@ -35,7 +82,16 @@ struct Document::Data {
     int pageCount;
     pdf_obj *info;
     PageMode pageMode;
+    int layerCount;
     bool locked;
+    bool progressive;
+    Revision revision;
+    RenderOptions renderOptions;
+    QByteArray password;
+    ImageCache images;
+    // Only used for documents with layers
+    DisplayListCache lists;
+    GrayPages grayPages;
 
     pdf_document *pdf() const
     {
@@ -60,6 +116,7 @@ struct Document::Data {
         }
 
         pageCount = fz_count_pages(ctx, mdoc);
+        layerCount = pdf_count_layer_config_ui(ctx, pdf());
         pdf_obj *obj = pdf_dict_gets(ctx, root, "PageMode");
 
         if (obj && pdf_is_name(ctx, obj)) {
@@ -82,6 +139,162 @@ struct Document::Data {
 
         return true;
     }
+    QByteArray layerState() const
+    {
+        QByteArray state(layerCount, '0');
+
+        for (int i = 0; i < layerCount; ++i) {
+            pdf_layer_config_ui info;
+            pdf_layer_config_ui_info(ctx, pdf(), i, &info);
+
+            if (info.type != PDF_LAYER_UI_LABEL && info.selected) {
+                state[i] = '1';
+            }
+        }
+
+        return state;
+    }
+    // Runs f and, as long as it fails because a progressively loaded file
+    // hasn't arrived far enough, waits for more data and runs it again.
+    template<typename F>
+    bool retryLater(F f)
+    {
+        for (;;) {
+            bool ok = false;
+            int error = 0;
+            fz_var(ok);
+
+            fz_try(ctx) {
+                ok = f();
+            }
+            fz_catch(ctx) {
+                error = fz_caught(ctx);
+            }
+
+            if (error != FZ_ERROR_TRYLATER || !progressive || !waitForProgressiveStream(stream)) {
+                return ok;
+            }
+        }
+    }
+    bool open()
+    {
+        char *oldlocale = std::setlocale(LC_NUMERIC, "C");
+        const bool opened = retryLater([this] {
+            if (!mdoc) {
+                mdoc = fz_open_document_with_stream(ctx, "pdf", stream);
+            }
+
+            locked = mdoc && fz_needs_password(ctx, mdoc);
+            return mdoc != nullptr;
+        });
+
+        if (oldlocale) {
+            std::setlocale(LC_NUMERIC, oldlocale);
+        }
+
+        if (!opened) {
+            qWarning() << "Error when trying to load document";
+            fz_drop_document(ctx, mdoc);
+            mdoc = nullptr;
+            fz_drop_stream(ctx, stream);
+            stream = nullptr;
+            progressive = false;
+            return false;
+        }
+
+        if (!locked) {
+            return loadUnlocked();
+        }
+
+        return true;
+    }
+    bool loadUnlocked()
+    {
+        if (!retryLater([this] { return load(); })) {
+            return false;
+        }
+
+        lists.setConfiguration(layerState());
+        return true;
+    }
+    void readRevision(const QString &fileName)
+    {
+        auto file = std::make_shared<QFile>(fileName);
+        revision = Revision();
+
+        if (!file->open(QIODevice::ReadOnly)) {
+            return;
+        }
+
+        revision.fileName = fileName;
+        revision.size = file->size();
+        revision.startxref = pdf()->startxref;
+        revision.file = file;
+    }
+    // Whether the object was written after the first size bytes of the file
+    bool isAppended(int num, qint64 size)
+    {
+        pdf_xref_entry *entry = pdf_get_xref_entry(ctx, pdf(), num);
+
+        // Compressed objects are as new as their object stream
+        if (entry && entry->type == 'o') {
+            entry = pdf_get_xref_entry(ctx, pdf(), entry->ofs);
+        }
+
+        return !entry || entry->type != 'n' || entry->ofs >= size;
+    }
+    // Whether anything reachable from obj, without leaving its page, is in
+    // appended. Has to be called inside fz_try.
+    bool reachesAppended(pdf_obj *obj, pdf_obj *page, const QSet<int> &appended, QSet<int> &visited)
+    {
+        if (pdf_is_indirect(ctx, obj)) {
+            const int num = pdf_to_num(ctx, obj);
+
+            if (visited.contains(num)) {
+                return false;
+            }
+
+            visited.insert(num);
+
+            if (appended.contains(num)) {
+                return true;
+            }
+
+            obj = pdf_resolve_indirect(ctx, obj);
+        }
+
+        if (pdf_is_array(ctx, obj)) {
+            const int len = pdf_array_len(ctx, obj);
+
+            for (int i = 0; i < len; ++i) {
+                if (reachesAppended(pdf_array_get(ctx, obj, i), page, appended, visited)) {
+                    return true;
+                }
+            }
+        } else if (pdf_is_dict(ctx, obj)) {
+            // Other pages, e.g. link destinations, are checked on their own
+            if (obj != page && (pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME(Type)), PDF_NAME(Page))
+                                || pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME(Type)), PDF_NAME(Pages)))) {
+                return false;
+            }
+
+            const int len = pdf_dict_len(ctx, obj);
+
+            for (int i = 0; i < len; ++i) {
+                pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+
+                if (pdf_name_eq(ctx, key, PDF_NAME(Parent)) || pdf_name_eq(ctx, key, PDF_NAME(P))) {
+                    continue;
+                }
+
+                if (reachesAppended(pdf_dict_get_val(ctx, obj, i), page, appended, visited)) {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
     void convertOutline(fz_outline *out, Outline *item)
     {
         for (; out; out = out->next) {
@@ -92,15 +305,16 @@ struct Document::Data {
     }
 };
 
-Document::Document()
-    : d(new Data)
+Document::Document(size_t storeSize)
+    : d(new Data(storeSize))
 {
-    fz_register_document_handlers(d->ctx);
 }
 
 Document::~Document()
 {
     close();
+    d->images.clear(d->ctx);
+    d->lists.clear(d->ctx);
     fz_drop_context(d->ctx);
     delete d;
 }
@@ -110,45 +324,52 @@ bool Document::load(const QString &fileName)
     QByteArray fileData = QFile::encodeName(fileName);
     d->stream = fz_open_file(d->ctx, fileData.constData());
 
-    if (!d->stream) {
+    if (!d->stream || !d->open()) {
         return false;
     }
 
-    char *oldlocale = std::setlocale(LC_NUMERIC, "C");
-    fz_try(d->ctx) {
-        d->mdoc = fz_open_document_with_stream(d->ctx, "pdf", d->stream);
-    }
-    fz_catch(d->ctx) {
-        qWarning() << "Error when trying to load document";
-        d->mdoc = nullptr;
-        return false;
-    }
+    d->readRevision(fileName);
+    return true;
+}
 
-    if (oldlocale) {
-        std::setlocale(LC_NUMERIC, oldlocale);
-    }
+bool Document::loadProgressively(const QString &fileName, qint64 bytesPerSecond,
+                                 const std::function<void()> &progress)
+{
+    d->stream = openProgressiveStream(d->ctx, fileName, bytesPerSecond, progress);
 
-    if (!d->mdoc) {
+    if (!d->stream) {
         return false;
     }
 
-    d->locked = fz_needs_password(d->ctx, d->mdoc);
+    d->progressive = true;
 
-    if (!d->locked) {
-        if (!d->load()) {
-            return false;
-        }
+    if (!d->open()) {
+        return false;
     }
 
+    d->readRevision(fileName);
     return true;
 }
 
+bool Document::isComplete() const
+{
+    return !d->progressive || isProgressiveStreamComplete(d->stream);
+}
+
+bool Document::isLoading() const
+{
+    return d->progressive && !isProgressiveStreamComplete(d->stream) && !isProgressiveStreamFailed(d->stream);
+}
+
 void Document::close()
 {
     if (!d->mdoc) {
         return;
     }
 
+    d->images.clear(d->ctx);
+    d->lists.clear(d->ctx);
+    d->grayPages.clear();
     fz_drop_document(d->ctx, d->mdoc);
     d->mdoc = nullptr;
     fz_drop_stream(d->ctx, d->stream);
@@ -156,7 +377,11 @@ void Document::close()
     d->pageCount = 0;
     d->info = nullptr;
     d->pageMode = UseNone;
+    d->layerCount = 0;
     d->locked = false;
+    d->progressive = false;
+    d->revision = Revision();
+    d->password.clear();
 }
 
 bool Document::isLocked() const
@@ -164,6 +389,11 @@ bool Document::isLocked() const
     return d->locked;
 }
 
+bool Document::isEncrypted() const
+{
+    return d->mdoc && d->dict("Encrypt");
+}
+
 bool Document::unlock(const QByteArray &password)
 {
     if (!d->locked) {
@@ -177,8 +407,9 @@ bool Document::unlock(const QByteArray &password)
     }
 
     d->locked = false;
+    d->password = password;
 
-    if (!d->load()) {
+    if (!d->loadUnlocked()) {
         return false;
     }
 
@@ -192,7 +423,8 @@ int Document::pageCount() const
 
 Page Document::page(int pageno) const
 {
-    return Page(d->ctx, d->mdoc, pageno);
+    return Page(d->ctx, d->mdoc, pageno, d->renderOptions, &d->images,
+                d->layerCount ? &d->lists : nullptr, &d->grayPages);
 }
 
 QList<QByteArray> Document::infoKeys() const
@@ -280,6 +512,201 @@ fz_document *Document::doc() const
     return d->mdoc;
 }
 
+fz_context *Document::cloneContext() const
+{
+    return fz_clone_context(d->ctx);
+}
+
+fz_document *Document::openCopy(fz_context *ctx) const
+{
+    if (!d->mdoc || d->revision.fileName.isEmpty()) {
+        return nullptr;
+    }
+
+    const QByteArray fileData = QFile::encodeName(d->revision.fileName);
+    QByteArray password = d->password;
+    fz_document *copy = nullptr;
+    fz_var(copy);
+
+    fz_try(ctx) {
+        copy = fz_open_document(ctx, fileData.constData());
+
+        if (fz_needs_password(ctx, copy) && !fz_authenticate_password(ctx, copy, password.data())) {
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate");
+        }
+    }
+    fz_catch(ctx) {
+        fz_drop_document(ctx, copy);
+        return nullptr;
+    }
+
+    return copy;
+}
+
+QString Document::fileName() const
+{
+    return d->revision.fileName;
+}
+
+bool Document::savePages(const QString &fileName, const QVector<int> &pages,
+                         const std::function<void()> &opened) const
+{
+    fz_context *ctx = cloneContext();
+
+    if (!ctx) {
+        return false;
+    }
+
+    // Work on a copy so that this document can be used meanwhile
+    fz_document *copy = openCopy(ctx);
+
+    if (opened) {
+        opened();
+    }
+    const QByteArray fileData = QFile::encodeName(fileName);
+    pdf_document *out = nullptr;
+    pdf_graft_map *map = nullptr;
+    bool ok = copy;
+    fz_var(out);
+    fz_var(map);
+    fz_var(ok);
+
+    if (copy) {
+        fz_try(ctx) {
+            pdf_document *pdf = pdf_document_from_fz_document(ctx, copy);
+
+            if (!pdf) {
+                fz_throw(ctx, FZ_ERROR_GENERIC, "not a PDF document");
+            }
+
+            out = pdf_create_document(ctx);
+            map = pdf_new_graft_map(ctx, out);
+
+            for (int page : pages) {
+                pdf_graft_mapped_page(ctx, map, -1, pdf, page);
+            }
+
+            pdf_write_options options = pdf_default_write_options;
+            options.do_garbage = 1;
+            pdf_save_document(ctx, out, fileData.constData(), &options);
+        }
+        fz_always(ctx) {
+            pdf_drop_graft_map(ctx, map);
+            pdf_drop_document(ctx, out);
+        }
+        fz_catch(ctx) {
+            ok = false;
+        }
+    }
+
+    fz_drop_document(ctx, copy);
+    fz_drop_context(ctx);
+    return ok;
+}
+
+RenderOptions Document::renderOptions() const
+{
+    return d->renderOptions;
+}
+
+void Document::setRenderOptions(const RenderOptions &options)
+{
+    d->renderOptions = options;
+    applyRenderOptions(d->ctx);
+}
+
+ImageCache *Document::imageCache() const
+{
+    return &d->images;
+}
+
+GrayPages *Document::grayPages() const
+{
+    return &d->grayPages;
+}
+
+QVector<Document::Layer> Document::layers() const
+{
+    QVector<Layer> layers(d->layerCount);
+
+    for (int i = 0; i < d->layerCount; ++i) {
+        pdf_layer_config_ui info;
+        pdf_layer_config_ui_info(d->ctx, d->pdf(), i, &info);
+        Layer &layer = layers[i];
+        layer.text = QString::fromUtf8(info.text);
+        layer.depth = info.depth;
+        layer.type = info.type == PDF_LAYER_UI_CHECKBOX ? Layer::CheckBox
+            : info.type == PDF_LAYER_UI_RADIOBOX ? Layer::RadioBox
+            : Layer::Label;
+        layer.visible = layer.type != Layer::Label && info.selected;
+        layer.locked = info.locked;
+    }
+
+    return layers;
+}
+
+void Document::setLayerVisible(int index, bool visible)
+{
+    if (index < 0 || index >= d->layerCount) {
+        return;
+    }
+
+    fz_try(d->ctx) {
+        if (visible) {
+            pdf_select_layer_config_ui(d->ctx, d->pdf(), index);
+        } else {
+            pdf_deselect_layer_config_ui(d->ctx, d->pdf(), index);
+        }
+    }
+    fz_catch(d->ctx) {
+        qWarning() << "Cannot change layer" << index;
+    }
+
+    // Display lists recorded with other layers shown are kept for when
+    // they are shown again, while a page may be gray only with them
+    d->lists.setConfiguration(d->layerState());
+    d->grayPages.clear();
+}
+
+QByteArray Document::layerState() const
+{
+    return d->layerState();
+}
+
+void Document::setLayerState(const QByteArray &state)
+{
+    const QByteArray current = d->layerState();
+
+    if (state.size() != current.size()) {
+        return;
+    }
+
+    // Showing a radio box hides the others of its group, which state has
+    // hidden as well
+    for (int i = 0; i < current.size(); ++i) {
+        if (state.at(i) != current.at(i)) {
+            setLayerVisible(i, state.at(i) == '1');
+        }
+    }
+}
+
+void RenderOptions::apply(fz_context *ctx) const
+{
+    if (icc) {
+        fz_enable_icc(ctx);
+    } else {
+        fz_disable_icc(ctx);
+    }
+
+    fz_set_text_aa_level(ctx, textAA);
+    fz_set_graphics_aa_level(ctx, graphicsAA);
+}
+
+void Document::applyRenderOptions(fz_context *ctx) const
+{
+    d->renderOptions.apply(ctx);
+}
+
 float Document::pdfVersion() const
 {
     if (!d->mdoc) {
@@ -304,6 +731,108 @@ Document::PageMode Document::pageMode() const
     return d->pageMode;
 }
 
+Document::Revision Document::revision() const
+{
+    return d->revision;
+}
+
+int Document::pageObjectNumber(int page) const
+{
+    int num = 0;
+
+    fz_try(d->ctx) {
+        num = pdf_to_num(d->ctx, pdf_lookup_page_obj(d->ctx, d->pdf(), page));
+    }
+    fz_catch(d->ctx) {
+        num = 0;
+    }
+
+    return num;
+}
+
+QSet<int> Document::unchangedPages(const Revision &old) const
+{
+    const Revision &current = d->revision;
+    QSet<int> unchanged;
+
+    // Incremental updates leave the old file as it was and append changed
+    // objects and a cross-reference section for them. Check objects for
+    // being written past its end, isPrefix() compares the bytes before.
+    if (!d->mdoc || d->locked || old.fileName != current.fileName || current.size <= old.size) {
+        return unchanged;
+    }
+
+    // Filled inside fz_try, which must not skip their destructors
+    QSet<int> appended;
+    QSet<int> visited;
+
+    fz_try(d->ctx) {
+        if (d->pdf()->startxref < old.size) {
+            fz_throw(d->ctx, FZ_ERROR_GENERIC, "not an incremental update");
+        }
+
+        const int count = pdf_xref_len(d->ctx, d->pdf());
+
+        for (int num = 1; num < count; ++num) {
+            if (d->isAppended(num, old.size)) {
+                appended.insert(num);
+            }
+        }
+
+        for (int i = 0; i < d->pageCount; ++i) {
+            pdf_obj *page = pdf_lookup_page_obj(d->ctx, d->pdf(), i);
+            visited.clear();
+            bool changed = d->reachesAppended(page, page, appended, visited);
+
+            // Attributes inherited from the page tree
+            for (pdf_obj *key : {PDF_NAME(Resources), PDF_NAME(MediaBox), PDF_NAME(CropBox), PDF_NAME(Rotate)}) {
+                if (!changed && !pdf_dict_get(d->ctx, page, key)) {
+                    changed = d->reachesAppended(pdf_dict_get_inheritable(d->ctx, page, key), page, appended, visited);
+                }
+            }
+
+            if (!changed) {
+                unchanged.insert(pdf_to_num(d->ctx, page));
+            }
+        }
+    }
+    fz_catch(d->ctx) {
+        unchanged.clear();
+    }
+
+    return unchanged;
+}
+
+bool Document::isPrefix(const Revision &old, const Revision &revision, const std::atomic<bool> &cancelled)
+{
+    struct stat previous;
+    struct stat current;
+
+    // Written to in place, the old file reads like the new one, which
+    // proves nothing
+    if (!old.file || !revision.file || revision.size <= old.size || fstat(old.file->handle(), &previous) < 0
+        || fstat(revision.file->handle(), &current) < 0 || previous.st_size != old.size
+        || (previous.st_dev == current.st_dev && previous.st_ino == current.st_ino)
+        || !old.file->seek(0) || !revision.file->seek(0)) {
+        return false;
+    }
+
+    QByteArray oldData(s_compareBlock, Qt::Uninitialized);
+    QByteArray data(s_compareBlock, Qt::Uninitialized);
+
+    for (qint64 left = old.size; left > 0; left -= s_compareBlock) {
+        const qint64 size = qMin(left, s_compareBlock);
+
+        if (cancelled || old.file->read(oldData.data(), size) != size
+            || revision.file->read(data.data(), size) != size
+            || memcmp(oldData.constData(), data.constData(), size) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 /******************************************************************************/
 
 Outline::Outline(const fz_outline *out)
@@ -16,15 +16,37 @@ extern "C" {
 
 #include <okular/core/document.h>
 
+#include <QFile>
+#include <QSet>
 #include <QString>
 #include <QVector>
 
+#include <atomic>
+#include <functional>
+#include <memory>
+
 namespace QMuPDF
 {
 
+class DisplayListCache;
+class GrayPages;
+class ImageCache;
 class Page;
 class Outline;
 
+// Trades rendering fidelity for speed, see MuPDFSettings::RenderProfile
+struct RenderOptions {
+    bool icc = true;
+    int textAA = 8;
+    int graphicsAA = 8;
+    // Simulates overprinting on pages using it, which is slow
+    bool overprint = false;
+
+    // Sets up ctx to render with these options, e.g. a cloned context
+    void apply(fz_context *ctx) const;
+    bool operator==(const RenderOptions &other) const = default;
+};
+
 class Document
 {
 public:
@@ -36,11 +58,50 @@ public:
         UseOC,
         UseAttachments
     };
-    Document();
+    // Identifies the file a document was loaded from, to tell whether the
+    // file was only extended by incremental updates when reloading it
+    struct Revision {
+        QString fileName;
+        qint64 size = 0;
+        qint64 startxref = 0;
+        // Kept open to compare the file with its next revision on reload. A
+        // file replaced by another one stays readable through it.
+        std::shared_ptr<QFile> file;
+    };
+    // An entry of the layer panel of the document, see layers()
+    struct Layer {
+        enum Type {
+            Label,
+            CheckBox,
+            // Showing it hides the other ones of its group
+            RadioBox
+        };
+        QString text;
+        int depth = 0;
+        Type type = Label;
+        bool visible = false;
+        bool locked = false;
+    };
+    // Documents share one store of cached resources, fonts and decoded
+    // images, its size in bytes is taken from the first one created.
+    explicit Document(size_t storeSize = FZ_STORE_DEFAULT);
     ~Document();
     bool load(const QString &fileName);
+    // Opens the document as soon as the data for its first page has been
+    // read and fetches the rest in the background, see
+    // openProgressiveStream(). Pages which haven't arrived yet can't be
+    // loaded until then.
+    bool loadProgressively(const QString &fileName, qint64 bytesPerSecond,
+                           const std::function<void()> &progress);
+    // Whether all of the file has been read
+    bool isComplete() const;
+    // Whether more of the file is still to arrive, false once it was read
+    // completely or reading it failed
+    bool isLoading() const;
     void close();
     bool isLocked() const;
+    // Whether the file is encrypted, also without a password to open it
+    bool isEncrypted() const;
     bool unlock(const QByteArray &password);
     int pageCount() const;
     Page page(int page) const;
@@ -49,8 +110,48 @@ public:
     Outline *outline() const;
     float pdfVersion() const;
     PageMode pageMode() const;
+    Revision revision() const;
+    int pageObjectNumber(int page) const;
+    // Object numbers of the pages which are the same as in old, empty if
+    // this document isn't old with incremental updates appended. This only
+    // looks at the objects, isPrefix() has to tell that the bytes of old
+    // are still there as well.
+    QSet<int> unchangedPages(const Revision &old) const;
+    // Whether the file of revision starts with all of the file of old,
+    // reading both of them, which takes a while for large files. Gives up
+    // as soon as cancelled is set. Can be called from any thread.
+    static bool isPrefix(const Revision &old, const Revision &revision, const std::atomic<bool> &cancelled);
     fz_context *ctx() const;
     fz_document *doc() const;
+    // Returns a context sharing the store of ctx() for use in another
+    // thread, the caller has to drop it.
+    fz_context *cloneContext() const;
+    // Opens the file again on ctx, e.g. a cloned context, to work with it in
+    // parallel to this document. The caller has to drop it.
+    fz_document *openCopy(fz_context *ctx) const;
+    QString fileName() const;
+    // Writes the given pages, counted from 0, to a new PDF file. opened is
+    // called once the copy it works on is open, from then on this document
+    // isn't used anymore.
+    bool savePages(const QString &fileName, const QVector<int> &pages,
+                   const std::function<void()> &opened = nullptr) const;
+    RenderOptions renderOptions() const;
+    void setRenderOptions(const RenderOptions &options);
+    // Applies renderOptions() to a context cloned before they changed
+    void applyRenderOptions(fz_context *ctx) const;
+    // Decoded images of scanned pages, for rendering display lists of them
+    ImageCache *imageCache() const;
+    // Which pages are gray, for rendering display lists of them
+    GrayPages *grayPages() const;
+    // The optional content groups of the document, in the order and nesting
+    // its layer panel lists them
+    QVector<Layer> layers() const;
+    // Shows or hides the layer at index in layers()
+    void setLayerVisible(int index, bool visible);
+    // Which layers are shown, to show the same ones in a copy of the
+    // document, e.g. in another process
+    QByteArray layerState() const;
+    void setLayerState(const QByteArray &state);
 private:
     Q_DISABLE_COPY(Document)
     struct Data;
@@ -0,0 +1,263 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "exporter.hpp"
+#include "document.hpp"
+#include "page.hpp"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QFile>
+#include <QHash>
+#include <QImage>
+#include <QThread>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace QMuPDF
+{
+
+// Pages each thread may get ahead of the writer
+static const int s_pagesAhead = 4;
+
+struct ExportQueue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    QHash<int, QByteArray> done;
+    // Workers which opened their copy of the document
+    int opened = 0;
+    int next = 0;
+    int written = 0;
+    bool failed = false;
+};
+
+// Returns an empty array for a page image that can't be made, which leaves
+// the page out of the archive, so that a damaged page doesn't fail the
+// whole export.
+static QByteArray exportPage(fz_context *ctx, fz_document *doc, int number, Exporter::Format format, qreal dpi,
+                             const RenderOptions &options)
+{
+    const Page page(ctx, doc, number, options);
+    // Pages are separated by form feeds, like pdftotext does
+    const QByteArray separator("\f");
+
+    if (!page.isValid()) {
+        qWarning() << "Cannot load page" << number + 1 << "to export it";
+        return format == Exporter::PlainText ? separator : QByteArray();
+    }
+
+    if (format == Exporter::PlainText) {
+        return page.text().toUtf8() + separator;
+    }
+
+    const QSizeF size = page.size(QSizeF(dpi, dpi));
+    const QImage image = page.render(qRound(size.width()), qRound(size.height()));
+    QByteArray png;
+    QBuffer buffer(&png);
+
+    if (image.isNull() || !buffer.open(QIODevice::WriteOnly)
+        || !image.save(&buffer, "PNG")) {
+        qWarning() << "Cannot render page" << number + 1 << "to export it";
+        return QByteArray();
+    }
+
+    return png;
+}
+
+static bool writeZipEntry(fz_context *ctx, fz_zip_writer *zip, const QByteArray &name, const QByteArray &data)
+{
+    fz_buffer *buffer = nullptr;
+    fz_var(buffer);
+
+    fz_try(ctx) {
+        buffer = fz_new_buffer_from_copied_data(ctx, reinterpret_cast<const unsigned char *>(data.constData()),
+                                                data.size());
+        // PNG is compressed already
+        fz_write_zip_entry(ctx, zip, name.constData(), buffer, 0);
+    }
+    fz_always(ctx) {
+        fz_drop_buffer(ctx, buffer);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
+
+    return true;
+}
+
+static fz_zip_writer *openZip(fz_context *ctx, const QString &fileName)
+{
+    const QByteArray fileData = QFile::encodeName(fileName);
+    fz_zip_writer *zip = nullptr;
+    fz_var(zip);
+
+    fz_try(ctx) {
+        zip = fz_new_zip_writer(ctx, fileData.constData());
+    }
+    fz_catch(ctx) {
+        return nullptr;
+    }
+
+    return zip;
+}
+
+static bool closeZip(fz_context *ctx, fz_zip_writer *zip)
+{
+    bool ok = true;
+    fz_var(ok);
+
+    fz_try(ctx) {
+        fz_close_zip_writer(ctx, zip);
+    }
+    fz_always(ctx) {
+        fz_drop_zip_writer(ctx, zip);
+    }
+    fz_catch(ctx) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+Exporter::Exporter(const Document &doc)
+    : m_doc(doc), m_dpi(150)
+{
+}
+
+void Exporter::setDpi(qreal dpi)
+{
+    m_dpi = dpi;
+}
+
+bool Exporter::exportTo(const QString &fileName, Format format, const std::function<void()> &opened)
+{
+    const int pageCount = m_doc.pageCount();
+    const int threadCount = qBound(1, QThread::idealThreadCount(), qMax(1, pageCount));
+    const RenderOptions options = m_doc.renderOptions();
+    const qreal dpi = m_dpi;
+    ExportQueue queue;
+    std::vector<std::thread> workers;
+
+    for (int i = 0; i < threadCount; ++i) {
+        fz_context *ctx = m_doc.cloneContext();
+
+        if (!ctx) {
+            break;
+        }
+
+        options.apply(ctx);
+        workers.emplace_back([this, ctx, pageCount, threadCount, format, dpi, options, &queue] {
+            fz_document *copy = m_doc.openCopy(ctx);
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                ++queue.opened;
+            }
+            queue.changed.notify_all();
+
+            for (;;) {
+                int number;
+                {
+                    std::unique_lock<std::mutex> lock(queue.mutex);
+                    queue.changed.wait(lock, [&] {
+                        return queue.failed || queue.next >= pageCount
+                            || queue.next < queue.written + threadCount * s_pagesAhead;
+                    });
+
+                    if (queue.failed || queue.next >= pageCount) {
+                        break;
+                    }
+
+                    number = queue.next++;
+                }
+
+                const QByteArray data = copy ? exportPage(ctx, copy, number, format, dpi, options) : QByteArray();
+                {
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+
+                    if (copy) {
+                        queue.done.insert(number, data);
+                    } else {
+                        queue.failed = true;
+                    }
+                }
+                queue.changed.notify_all();
+            }
+
+            fz_drop_document(ctx, copy);
+            fz_drop_context(ctx);
+        });
+    }
+
+    // The writer needs a context of its own as well
+    fz_context *ctx = m_doc.cloneContext();
+    {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.changed.wait(lock, [&] { return queue.opened == int(workers.size()); });
+    }
+
+    if (opened) {
+        opened();
+    }
+
+    QFile file(fileName);
+    fz_zip_writer *zip = nullptr;
+    bool ok = !workers.empty() && ctx;
+
+    if (ok && format == PlainText) {
+        ok = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    } else if (ok) {
+        zip = openZip(ctx, fileName);
+        ok = zip;
+    }
+
+    for (int number = 0; ok && number < pageCount; ++number) {
+        QByteArray data;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.changed.wait(lock, [&] { return queue.failed || queue.done.contains(number); });
+
+            if (queue.failed) {
+                ok = false;
+                break;
+            }
+
+            data = queue.done.take(number);
+            ++queue.written;
+        }
+        queue.changed.notify_all();
+
+        if (format == PlainText) {
+            ok = file.write(data) == data.size();
+        } else if (!data.isEmpty()) {
+            ok = writeZipEntry(ctx, zip, QString::asprintf("%05d.png", number + 1).toUtf8(), data);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.failed = queue.failed || !ok;
+    }
+    queue.changed.notify_all();
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    if (zip) {
+        ok = closeZip(ctx, zip) && ok;
+    }
+
+    fz_drop_context(ctx);
+    return ok;
+}
+
+} // namespace QMuPDF
@@ -0,0 +1,52 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_EXPORTER_HPP
+#define QMUPDF_EXPORTER_HPP
+
+#include <QString>
+
+#include <functional>
+
+namespace QMuPDF
+{
+
+class Document;
+
+// Exports all pages of a document using one thread per core. Every thread
+// opens the file on a context of its own, so pages are also parsed in
+// parallel. Results are written in page order, with only a bounded number
+// of pages done ahead of the writer.
+class Exporter
+{
+public:
+    enum Format {
+        PlainText,
+        // PNG images of the pages in a comic book (zip) archive
+        PageImages
+    };
+
+    explicit Exporter(const Document &doc);
+
+    // Resolution of exported page images
+    void setDpi(qreal dpi);
+    // opened is called once the threads opened their copies of the
+    // document, which isn't used any more from then on. Pages that can't
+    // be exported are left out with a warning.
+    bool exportTo(const QString &fileName, Format format, const std::function<void()> &opened = nullptr);
+
+private:
+    Q_DISABLE_COPY(Exporter)
+    const Document &m_doc;
+    qreal m_dpi;
+};
+
+} // namespace QMuPDF
+
+#endif
@@ -8,26 +8,96 @@
  ***************************************************************************/
 
 #include "generator_mupdf.hpp"
+#include "exporter.hpp"
 #include "page.hpp"
+#include "ui_mupdfsettingswidget.h"
+#include "mupdfsettings.h"
 
 #include <okular/core/action.h>
+#include <okular/core/area.h>
+#include <okular/core/fileprinter.h>
 #include <okular/core/page.h>
 #include <okular/core/textpage.h>
 
+#include <KConfigDialog>
+#include <KFileSystemType>
 #include <KLocalizedString>
 
+#include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QIcon>
 #include <QImage>
+#include <QMimeDatabase>
 #include <QMutexLocker>
+#include <QPrinter>
+#include <QTemporaryFile>
+#include <QTimer>
 
 OKULAR_EXPORT_PLUGIN(MuPDFGenerator, "libokularGenerator_mupdf.json")
 
+// Files at least this large on network file systems are shown while they
+// are still being read
+static const qint64 s_progressiveSize = 16 * 1024 * 1024;
+// Delay in milliseconds before looking for arrived pages again, if a
+// render held the document
+static const int s_refreshRetry = 100;
+
+static bool shouldLoadProgressively(const QString &fileName)
+{
+    switch (KFileSystemType::fileSystemType(fileName)) {
+    case KFileSystemType::Nfs:
+    case KFileSystemType::Smb:
+        return QFileInfo(fileName).size() >= s_progressiveSize;
+    default:
+        return false;
+    }
+}
+
+static QMuPDF::RenderOptions renderOptions(int profile)
+{
+    QMuPDF::RenderOptions options;
+
+    switch (profile) {
+    case MuPDFSettings::EnumRenderProfile::Fast:
+        options.icc = false;
+        options.textAA = 4;
+        options.graphicsAA = 0;
+        break;
+    case MuPDFSettings::EnumRenderProfile::Accurate:
+        options.overprint = true;
+        break;
+    default:
+        break;
+    }
+
+    return options;
+}
+
 MuPDFGenerator::MuPDFGenerator(QObject *parent, const QVariantList &args)
     : Generator(parent, args)
+    , m_pdfdoc(size_t(MuPDFSettings::cacheSize()) * 1024 * 1024)
+    , m_prefetcher(m_pdfdoc, userMutex())
+    , m_glyphWarmer(m_pdfdoc, userMutex())
+    , m_renderProcesses(MuPDFSettings::maxRenderProcesses())
     , m_synopsis(nullptr)
+    , m_layersModel(nullptr)
+    , m_warmUpGlyphs(MuPDFSettings::warmUpGlyphs())
+    , m_renderInProcesses(MuPDFSettings::renderInProcesses())
+    , m_lastZoom(1)
+    , m_refreshQueued(false)
+    // QMUPDF_TRACE=<file> records the requests to replay them with
+    // qmupdf-replay
+    , m_trace(QFile::decodeName(qgetenv("QMUPDF_TRACE")))
 {
     setFeature(Threaded);
     setFeature(TextExtraction);
+    // Large zooms only render, and decode, the visible tiles
+    setFeature(TiledRendering);
+    setFeature(PrintNative);
+    setFeature(PrintToFile);
+    m_pdfdoc.setRenderOptions(renderOptions(MuPDFSettings::renderProfile()));
+    m_renderProcesses.setRenderOptions(m_pdfdoc.renderOptions());
 }
 
 MuPDFGenerator::~MuPDFGenerator() = default;
@@ -36,7 +106,22 @@ Okular::Document::OpenResult MuPDFGenerator::loadDocumentWithPassword(
     const QString &fileName, QVector<Okular::Page *> &pages,
     const QString &password)
 {
-    if (!m_pdfdoc.load(fileName)) {
+    // QMUPDF_PROGRESSIVE_THROTTLE=<KiB/s> loads progressively from a
+    // throttled stream, to try this with local files
+    const QByteArray throttle = qgetenv("QMUPDF_PROGRESSIVE_THROTTLE");
+    bool loaded;
+
+    if (!throttle.isEmpty() || shouldLoadProgressively(fileName)) {
+        loaded = m_pdfdoc.loadProgressively(fileName, throttle.toLongLong() * 1024, [this] {
+            if (!m_refreshQueued.exchange(true)) {
+                QMetaObject::invokeMethod(this, &MuPDFGenerator::refreshIncompletePages, Qt::QueuedConnection);
+            }
+        });
+    } else {
+        loaded = m_pdfdoc.load(fileName);
+    }
+
+    if (!loaded) {
         return Okular::Document::OpenError;
     }
 
@@ -49,25 +134,69 @@ Okular::Document::OpenResult MuPDFGenerator::loadDocumentWithPassword(
         }
     }
 
+    QVector<QSizeF> pageSizes;
+    pageSizes.reserve(m_pdfdoc.pageCount());
+    // A4, for pages that haven't arrived yet if no page before them has
+    QSizeF lastSize(595 * dpi().width() / 72., 842 * dpi().height() / 72.);
+
     for (int i = 0; i < m_pdfdoc.pageCount(); ++i) {
         QMuPDF::Page page = m_pdfdoc.page(i);
-        const QSizeF s = page.size(dpi());
+        QSizeF s = page.size(dpi());
+        if (page.isValid()) {
+            lastSize = s;
+        } else {
+            s = lastSize;
+        }
         const Okular::Rotation rot = Okular::Rotation0;
         Okular::Page *okularPage = new Okular::Page(i, s.width(), s.height(), rot);
         okularPage->setDuration(page.duration());
         pages.append(okularPage);
+        pageSizes.append(s);
     }
     rectsGenerated.fill(false, m_pdfdoc.pageCount());
+    m_pageSizes = pageSizes;
+    m_prefetcher.setPageSizes(pageSizes);
+    // Keeps what was generated before reloading for untouched pages, once
+    // the old file was found to be all there in the new one
+    m_pageCache.restore(m_pdfdoc, [this] {
+        QMetaObject::invokeMethod(this, &MuPDFGenerator::restorePages, Qt::QueuedConnection);
+    });
+    m_renderProcesses.open(fileName, password.toLocal8Bit());
+
+    const QVector<QMuPDF::Document::Layer> layers = m_pdfdoc.layers();
+    if (!layers.isEmpty()) {
+        m_layersModel = new QMuPDF::LayersModel(layers, [this](int layer, bool visible) {
+            return setLayerVisible(layer, visible);
+        });
+        m_renderProcesses.setLayerState(m_pdfdoc.layerState());
+    }
+    m_trace.begin(fileName, m_pdfdoc.pageCount());
+
+    // Have the glyphs of the first pages ready when they are requested,
+    // likely at the zoom of the last document. The prefetcher takes care
+    // of the pages after the visible ones.
+    if (m_warmUpGlyphs && !m_renderInProcesses && !pageSizes.isEmpty() && !m_pdfdoc.isLoading()) {
+        m_glyphWarmer.warm(0, (pageSizes.first() * m_lastZoom).toSize());
+    }
 
     return Okular::Document::OpenSuccess;
 }
 
 bool MuPDFGenerator::doCloseDocument()
 {
+    m_glyphWarmer.clear();
+    m_prefetcher.preempt();
     QMutexLocker locker(userMutex());
+    m_prefetcher.clear();
+    m_pageCache.retain(m_pdfdoc);
+    m_renderProcesses.close();
     m_pdfdoc.close();
+    m_pageSizes.clear();
+    m_incompletePages.clear();
     delete m_synopsis;
     m_synopsis = nullptr;
+    delete m_layersModel;
+    m_layersModel = nullptr;
     return true;
 }
 
@@ -185,31 +314,211 @@ static QLinkedList<Okular::ObjectRect *> generateLinks(const QVector<QMuPDF::Lin
 
 QImage MuPDFGenerator::image(Okular::PixmapRequest *request)
 {
+    const qint64 start = m_trace.now();
+    // Visible requests go before any speculative rendering
+    m_prefetcher.preempt();
+    m_glyphWarmer.preempt();
     QMutexLocker locker(userMutex());
     const auto okularPage = request->page();
     const auto pageNumber = okularPage->number();
+    const QSize size(request->width(), request->height());
+    // Caches and prefetching only deal with whole pages
+    const QRect tile = request->isTile() ? request->normalizedRect().geometry(size.width(), size.height()) : QRect();
     QMuPDF::Page page = m_pdfdoc.page(pageNumber);
-    QImage image = page.render(request->width(), request->height());
-    if (!rectsGenerated.at(pageNumber))
+    const bool remote = renderInProcesses();
+    if (!request->isPreload() && okularPage->width() > 0)
+    {
+        m_lastZoom = size.width() / okularPage->width();
+    }
+    QImage image;
+    if (tile.isNull())
+    {
+        image = m_pageCache.image(pageNumber, size);
+    }
+    if (image.isNull() && tile.isNull())
+    {
+        image = m_prefetcher.take(pageNumber, size);
+    }
+    bool incomplete = false;
+    bool failed = false;
+    if (image.isNull() && tile.isNull() && !remote && request->partialUpdatesWanted() && !m_pdfdoc.isLoading())
+    {
+        image = renderProgressively(request, page);
+    }
+    if (image.isNull() && remote)
+    {
+        // The helper doesn't need the document, let text requests at it
+        locker.unlock();
+        image = m_renderProcesses.render(pageNumber, size, tile, &incomplete);
+        locker.relock();
+        // A page crashing the helper is left blank, unless no helper could
+        // be started at all
+        failed = image.isNull() && m_renderProcesses.isAvailable();
+    }
+    if (failed)
+    {
+        image = QImage(tile.isNull() ? size : tile.size(), QImage::Format_Grayscale8);
+        image.fill(Qt::white);
+    }
+    if (image.isNull())
+    {
+        image = page.render(request->width(), request->height(), tile, &incomplete);
+    }
+    if (incomplete)
+    {
+        // Rendered again by refreshIncompletePages() once more data
+        // arrived, unless nothing more will
+        if (m_pdfdoc.isLoading())
+        {
+            m_incompletePages.insert(pageNumber);
+        }
+        if (image.isNull())
+        {
+            image = QImage(tile.isNull() ? size : tile.size(), QImage::Format_Grayscale8);
+            image.fill(Qt::white);
+        }
+    }
+    else if (tile.isNull() && !failed)
     {
-        okularPage->setObjectRects(generateLinks(page.links(dpi())));
+        m_incompletePages.remove(pageNumber);
+        m_pageCache.setImage(pageNumber, image);
+    }
+    if (!rectsGenerated.at(pageNumber) && !incomplete)
+    {
+        QVector<QMuPDF::Link> links;
+        if (!m_pageCache.links(pageNumber, &links))
+        {
+            links = page.links(dpi());
+            m_pageCache.setLinks(pageNumber, links);
+        }
+        okularPage->setObjectRects(generateLinks(links));
         rectsGenerated[pageNumber] = true;
     }
+    // Okular preloads on its own, only follow what is actually looked at.
+    // Tiles are too large to prefetch the pages around them at that zoom.
+    if (request->isPreload() || !tile.isNull() || remote)
+    {
+        m_prefetcher.resume();
+    }
+    else
+    {
+        m_prefetcher.schedule(pageNumber, size);
+    }
+    if (m_trace.isEnabled())
+    {
+        QMuPDF::TraceEntry entry;
+        entry.start = start;
+        entry.duration = m_trace.now() - start;
+        entry.page = pageNumber;
+        entry.size = size;
+        entry.tile = tile;
+        entry.priority = request->priority();
+        entry.preload = request->isPreload();
+        entry.options = m_pdfdoc.renderOptions();
+        entry.layers = m_pdfdoc.layerState();
+        entry.dpi = dpi();
+        m_trace.record(entry);
+    }
     return image;
 }
 
-static Okular::TextPage *buildTextPage(const QVector<QMuPDF::TextBox *> &boxes,
+QImage MuPDFGenerator::renderProgressively(Okular::PixmapRequest *request, const QMuPDF::Page &page)
+{
+    // Display lists are rasterized without simulating overprinting
+    fz_display_list *list = page.simulatesOverprint() ? nullptr : page.displayList();
+    if (!list)
+    {
+        return QImage();
+    }
+    // Show a rough version while the page is rasterized at full quality
+    const QImage draft = QMuPDF::Page::renderDraft(m_pdfdoc.ctx(), list, request->width(), request->height());
+    if (!draft.isNull())
+    {
+        // Okular turns it into a pixmap and updates its observers, which
+        // has to happen in the GUI thread
+        QMetaObject::invokeMethod(this, "signalPartialPixmapRequest", Qt::QueuedConnection,
+                                  Q_ARG(Okular::PixmapRequest *, request), Q_ARG(QImage, draft));
+    }
+    const QImage image = QMuPDF::Page::render(m_pdfdoc.ctx(), list, request->width(), request->height(),
+                                              nullptr, m_pdfdoc.imageCache(), m_pdfdoc.grayPages(), page.number());
+    fz_drop_display_list(m_pdfdoc.ctx(), list);
+    return image;
+}
+
+void MuPDFGenerator::refreshIncompletePages()
+{
+    // Don't keep the GUI waiting for a render, look again a bit later
+    if (!userMutex()->tryLock())
+    {
+        QTimer::singleShot(s_refreshRetry, this, &MuPDFGenerator::refreshIncompletePages);
+        return;
+    }
+    m_refreshQueued = false;
+    // Only pages rendered while incomplete are looked at, which are few.
+    // Once the file was read completely or reading it failed they are all
+    // rendered for the last time.
+    const bool loading = m_pdfdoc.isLoading();
+    QList<int> ready;
+    for (auto it = m_incompletePages.begin(); it != m_incompletePages.end();)
+    {
+        if (!loading || m_pdfdoc.page(*it).isValid())
+        {
+            ready.append(*it);
+            it = m_incompletePages.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    userMutex()->unlock();
+    // Okular offers no other way for generators to have pixmaps replaced
+    auto *okularDocument = const_cast<Okular::Document *>(document());
+    for (int page : ready)
+    {
+        okularDocument->refreshPixmaps(page);
+    }
+}
+
+void MuPDFGenerator::restorePages()
+{
+    QMutexLocker locker(userMutex());
+    m_pageCache.finishRestore();
+}
+
+bool MuPDFGenerator::renderInProcesses() const
+{
+    // Helpers open the file on their own, which has to be read already
+    return m_renderInProcesses && m_renderProcesses.isAvailable() && !m_pdfdoc.isLoading();
+}
+
+QVector<QMuPDF::Document::Layer> MuPDFGenerator::setLayerVisible(int layer, bool visible)
+{
+    m_prefetcher.preempt();
+    QMutexLocker locker(userMutex());
+    m_pdfdoc.setLayerVisible(layer, visible);
+    m_renderProcesses.setLayerState(m_pdfdoc.layerState());
+    // Drop what was rendered with the other layers, the display lists of
+    // the pages are kept by the document
+    m_prefetcher.clear();
+    m_pageCache.clear();
+    m_prefetcher.setPageSizes(m_pageSizes);
+    m_prefetcher.resume();
+    return m_pdfdoc.layers();
+}
+
+static Okular::TextPage *buildTextPage(const QVector<QMuPDF::TextBox> &boxes,
                                        qreal width, qreal height)
 {
     Okular::TextPage *ktp = new Okular::TextPage();
 
     for (int i = 0; i < boxes.size(); ++i) {
-        QMuPDF::TextBox *box = boxes.at(i);
-        const QChar c = box->text();
-        const QRectF charBBox = box->rect();
+        const QMuPDF::TextBox &box = boxes.at(i);
+        const QChar c = box.text();
+        const QRectF charBBox = box.rect();
         QString text(c);
 
-        if (box->isAtEndOfLine()) {
+        if (box.isAtEndOfLine()) {
             text.append(QLatin1Char('\n'));
         }
 
@@ -223,15 +532,179 @@ static Okular::TextPage *buildTextPage(const QVector<QMuPDF::TextBox *> &boxes,
 
 Okular::TextPage *MuPDFGenerator::textPage(Okular::TextRequest *request)
 {
+    const qint64 start = m_trace.now();
+    m_prefetcher.preempt();
     QMutexLocker locker(userMutex());
-    QMuPDF::Page mp = m_pdfdoc.page(request->page()->number());
-    const QVector<QMuPDF::TextBox *> boxes = mp.textBoxes(dpi());
+    const int pageNumber = request->page()->number();
+    QMuPDF::Page mp = m_pdfdoc.page(pageNumber);
+    QVector<QMuPDF::TextBox> boxes;
+    if (!m_pageCache.text(pageNumber, &boxes)) {
+        bool remote = renderInProcesses();
+        bool failed = false;
+        if (remote) {
+            locker.unlock();
+            failed = !m_renderProcesses.textBoxes(pageNumber, dpi(), &boxes);
+            locker.relock();
+            // Leaves the page without text if it crashed the helper
+            remote = !failed || m_renderProcesses.isAvailable();
+            if (failed) {
+                boxes.clear();
+            }
+        }
+        if (!remote) {
+            const QVector<QMuPDF::TextBox *> found = mp.textBoxes(dpi());
+            for (const QMuPDF::TextBox *box : found) {
+                boxes.append(*box);
+            }
+            qDeleteAll(found);
+            failed = false;
+        }
+        if (!failed) {
+            m_pageCache.setText(pageNumber, boxes);
+        }
+    }
     const QSizeF s = mp.size(dpi());
     Okular::TextPage *tp = buildTextPage(boxes, s.width(), s.height());
-    qDeleteAll(boxes);
+    m_prefetcher.resume();
+    if (m_trace.isEnabled()) {
+        QMuPDF::TraceEntry entry;
+        entry.kind = QMuPDF::TraceEntry::Text;
+        entry.start = start;
+        entry.duration = m_trace.now() - start;
+        entry.page = pageNumber;
+        entry.options = m_pdfdoc.renderOptions();
+        entry.layers = m_pdfdoc.layerState();
+        entry.dpi = dpi();
+        m_trace.record(entry);
+    }
     return tp;
 }
 
+Okular::Document::PrintError MuPDFGenerator::print(QPrinter &printer)
+{
+    m_prefetcher.preempt();
+    QMutexLocker locker(userMutex());
+    const QList<int> pageList = Okular::FilePrinter::pageList(printer, m_pdfdoc.pageCount(),
+                                                              document()->currentPage() + 1,
+                                                              document()->bookmarkedPageList());
+    QVector<int> pages;
+    for (int page : pageList) {
+        pages.append(page - 1);
+    }
+
+    // The print system can't open encrypted files, savePages() writes them
+    // unencrypted
+    bool allPages = !m_pdfdoc.isEncrypted() && pages.size() == m_pdfdoc.pageCount();
+    for (int i = 0; allPages && i < pages.size(); ++i) {
+        allPages = pages.at(i) == i;
+    }
+
+    // The PDF goes to the print system as is, without rasterizing pages
+    if (allPages) {
+        const QString fileName = m_pdfdoc.fileName();
+        locker.unlock();
+        m_prefetcher.resume();
+        return Okular::FilePrinter::printFile(printer, fileName, document()->orientation(),
+                                              Okular::FilePrinter::ApplicationDeletesFiles,
+                                              Okular::FilePrinter::ApplicationSelectsPages);
+    }
+
+    QTemporaryFile tf(QDir::tempPath() + QLatin1String("/okular_mupdf_XXXXXX.pdf"));
+    if (!tf.open()) {
+        m_prefetcher.resume();
+        return Okular::Document::TemporaryFileOpenPrintError;
+    }
+    tf.setAutoRemove(false);
+    const QString tempFileName = tf.fileName();
+    tf.close();
+
+    // Pages are saved from a copy of the document, rendering can go on
+    // meanwhile
+    const bool saved = m_pdfdoc.savePages(tempFileName, pages, [&] {
+        m_prefetcher.resume();
+        locker.unlock();
+    });
+    m_prefetcher.resume();
+
+    if (!saved) {
+        QFile::remove(tempFileName);
+        return Okular::Document::FileConversionPrintError;
+    }
+
+    return Okular::FilePrinter::printFile(printer, tempFileName, document()->orientation(),
+                                          Okular::FilePrinter::SystemDeletesFiles,
+                                          Okular::FilePrinter::ApplicationSelectsPages);
+}
+
+Okular::ExportFormat::List MuPDFGenerator::exportFormats() const
+{
+    static Okular::ExportFormat::List formats;
+    if (formats.isEmpty()) {
+        formats.append(Okular::ExportFormat::standardFormat(Okular::ExportFormat::PlainText));
+        formats.append(Okular::ExportFormat(QIcon::fromTheme(QStringLiteral("image-x-generic")),
+                                            i18n("Page Images (CBZ)"),
+                                            QMimeDatabase().mimeTypeForName(QStringLiteral("application/vnd.comicbook+zip"))));
+    }
+
+    return formats;
+}
+
+bool MuPDFGenerator::exportTo(const QString &fileName, const Okular::ExportFormat &format)
+{
+    const QMuPDF::Exporter::Format exportFormat = format.mimeType().inherits(QStringLiteral("text/plain"))
+                                                  ? QMuPDF::Exporter::PlainText
+                                                  : QMuPDF::Exporter::PageImages;
+    m_prefetcher.preempt();
+    QMutexLocker locker(userMutex());
+    QMuPDF::Exporter exporter(m_pdfdoc);
+    exporter.setDpi(dpi().width());
+    // Pages are exported from copies of the document, rendering can go on
+    // meanwhile
+    const bool ok = !m_pdfdoc.isLoading() && exporter.exportTo(fileName, exportFormat, [&] {
+        m_prefetcher.resume();
+        locker.unlock();
+    });
+    m_prefetcher.resume();
+    return ok;
+}
+
+bool MuPDFGenerator::reparseConfig()
+{
+    const QMuPDF::RenderOptions options = renderOptions(MuPDFSettings::renderProfile());
+    m_prefetcher.preempt();
+    QMutexLocker locker(userMutex());
+    m_warmUpGlyphs = MuPDFSettings::warmUpGlyphs();
+    m_renderInProcesses = MuPDFSettings::renderInProcesses();
+
+    if (options == m_pdfdoc.renderOptions()) {
+        m_prefetcher.resume();
+        return false;
+    }
+
+    m_pdfdoc.setRenderOptions(options);
+    m_renderProcesses.setRenderOptions(options);
+    // Drop what was rendered with the old profile
+    m_prefetcher.clear();
+    m_pageCache.clear();
+    m_prefetcher.setPageSizes(m_pageSizes);
+    m_prefetcher.resume();
+    return true;
+}
+
+void MuPDFGenerator::addPages(KConfigDialog *dlg)
+{
+    Ui_MuPDFSettingsWidget mupdfw;
+    QWidget *w = new QWidget(dlg);
+    mupdfw.setupUi(w);
+    dlg->addPage(w, MuPDFSettings::self(), i18n("MuPDF"), QStringLiteral("application-pdf"),
+                 i18n("MuPDF Backend Configuration"));
+}
+
+QAbstractItemModel *MuPDFGenerator::layersModel() const
+{
+    return m_layersModel;
+}
+
 QVariant MuPDFGenerator::metaData(const QString &key,
                                   const QVariant &option) const
 {
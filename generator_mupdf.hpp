@@ -11,18 +11,29 @@
 #define GENERATOR_MUPDF_H
 
 #include "document.hpp"
+#include "glyphwarmer.hpp"
+#include "layersmodel.hpp"
+#include "pagecache.hpp"
+#include "prefetcher.hpp"
+#include "renderprocesses.hpp"
+#include "trace.hpp"
 
 #include <okular/core/document.h>
 #include <okular/core/generator.h>
 #include <okular/core/sourcereference.h>
 #include <okular/core/version.h>
+#include <okular/interfaces/configinterface.h>
 
 #include <QBitArray>
+#include <QSet>
 
-class MuPDFGenerator : public Okular::Generator
+#include <atomic>
+
+class MuPDFGenerator : public Okular::Generator, public Okular::ConfigInterface
 {
     Q_OBJECT
     Q_INTERFACES(Okular::Generator)
+    Q_INTERFACES(Okular::ConfigInterface)
 
 public:
     MuPDFGenerator(QObject *parent, const QVariantList &args);
@@ -35,6 +46,16 @@ public:
     Okular::DocumentInfo generateDocumentInfo(const QSet<Okular::DocumentInfo::Key> &keys) const override;
     const Okular::DocumentSynopsis *generateDocumentSynopsis() override;
     QVariant metaData(const QString &key, const QVariant &option) const override;
+    QAbstractItemModel *layersModel() const override;
+
+    Okular::Document::PrintError print(QPrinter &printer) override;
+
+    Okular::ExportFormat::List exportFormats() const override;
+    bool exportTo(const QString &fileName, const Okular::ExportFormat &format) override;
+
+    // [INHERITED] reparse configuration
+    bool reparseConfig() override;
+    void addPages(KConfigDialog *dlg) override;
 
 protected:
     bool doCloseDocument() override;
@@ -42,9 +63,31 @@ protected:
     Okular::TextPage *textPage(Okular::TextRequest *request) override;
 
 private:
+    QImage renderProgressively(Okular::PixmapRequest *request, const QMuPDF::Page &page);
+    void refreshIncompletePages();
+    void restorePages();
+    QVector<QMuPDF::Document::Layer> setLayerVisible(int layer, bool visible);
+    // Whether requests go to m_renderProcesses, has to be called holding
+    // userMutex()
+    bool renderInProcesses() const;
+
     QMuPDF::Document m_pdfdoc;
+    QMuPDF::Prefetcher m_prefetcher;
+    QMuPDF::GlyphWarmer m_glyphWarmer;
+    QMuPDF::RenderProcesses m_renderProcesses;
+    QMuPDF::PageCache m_pageCache;
     Okular::DocumentSynopsis *m_synopsis;
+    QMuPDF::LayersModel *m_layersModel;
+    bool m_warmUpGlyphs;
+    bool m_renderInProcesses;
+    // Of the last visible request, the next document is likely shown at
+    qreal m_lastZoom;
     QBitArray rectsGenerated;
+    QVector<QSizeF> m_pageSizes;
+    // Pages rendered before all of their data arrived
+    QSet<int> m_incompletePages;
+    std::atomic<bool> m_refreshQueued;
+    QMuPDF::Trace m_trace;
 };
 
 #endif
@@ -0,0 +1,226 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "glyphwarmer.hpp"
+#include "document.hpp"
+#include "page.hpp"
+
+#include <QMutexLocker>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace QMuPDF
+{
+
+// Pages warmed, the glyph cache is small
+static const int s_warmCount = 2;
+
+// Glyphs small enough to be cached are rasterized whole even where they
+// fall outside of the pixmap, while the draw device skips everything else
+// outside of it. So drawing onto a single pixel only fills the cache.
+static void warmList(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, fz_cookie *cookie)
+{
+    fz_pixmap *pixmap = nullptr;
+    fz_device *device = nullptr;
+    fz_var(pixmap);
+    fz_var(device);
+
+    fz_try(ctx) {
+        pixmap = fz_new_pixmap(ctx, fz_device_rgb(ctx), 1, 1, nullptr, 1);
+        device = fz_new_draw_device(ctx, fz_identity, pixmap);
+        // Not culled to the pixmap, which would skip the glyphs
+        fz_run_display_list(ctx, list, device, ctm, fz_infinite_rect, cookie);
+        fz_close_device(ctx, device);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+        fz_drop_pixmap(ctx, pixmap);
+    }
+    fz_catch(ctx) {
+    }
+}
+
+struct GlyphWarmer::Data {
+    Data(const Document &doc, QMutex *docMutex)
+        : doc(doc), docMutex(docMutex) { }
+
+    const Document &doc;
+    QMutex *docMutex;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread thread;
+    fz_cookie cookie = { 0, 0, 0, 0, 0 };
+    // Pending request, page is -1 if there is none
+    int page = -1;
+    QSize size;
+    RenderOptions options;
+    // Bumped by clear(), dropped tells up to which one the worker let go
+    quint64 generation = 0;
+    quint64 dropped = 0;
+    // Whether the worker holds the document mutex
+    bool recording = false;
+    bool quit = false;
+
+    // Records page of the document, which the glyphs of the list are the
+    // fonts of, under the document mutex like the prefetcher does
+    fz_display_list *record(int number)
+    {
+        QMutexLocker locker(docMutex);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (cookie.abort) {
+                return nullptr;
+            }
+
+            recording = true;
+        }
+
+        fz_display_list *list = nullptr;
+
+        if (doc.doc() && number < doc.pageCount()) {
+            list = doc.page(number).displayList(&cookie);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        recording = false;
+        return list;
+    }
+
+    void run(fz_context *ctx)
+    {
+        for (;;) {
+            int first;
+            QSize firstSize;
+            RenderOptions firstOptions;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                dropped = generation;
+                wakeup.notify_all();
+                wakeup.wait(lock, [&] { return quit || page >= 0 || dropped != generation; });
+
+                if (quit) {
+                    break;
+                }
+
+                if (page < 0) {
+                    continue;
+                }
+
+                first = page;
+                firstSize = size;
+                firstOptions = options;
+                page = -1;
+                cookie = { 0, 0, 0, 0, 0 };
+            }
+
+            // Glyphs are cached per scale and anti-aliasing level
+            firstOptions.apply(ctx);
+            fz_rect bounds = fz_empty_rect;
+
+            // warm() is only called while the document is loaded, and
+            // clear() waits for this to let go of its lists before it is
+            // closed
+            for (int n = first; n < first + s_warmCount; ++n) {
+                fz_display_list *list = record(n);
+
+                if (!list) {
+                    break;
+                }
+
+                // Same scale for the next page as for the first one
+                const fz_rect b = fz_bound_display_list(ctx, list);
+
+                if (n == first) {
+                    bounds = b;
+                }
+
+                if (!fz_is_empty_rect(b) && !fz_is_empty_rect(bounds)) {
+                    const qreal w = qRound(firstSize.width() * (b.x1 - b.x0) / (bounds.x1 - bounds.x0));
+                    const qreal h = qRound(firstSize.height() * (b.y1 - b.y0) / (bounds.y1 - bounds.y0));
+                    warmList(ctx, list, fz_scale(w / (b.x1 - b.x0), h / (b.y1 - b.y0)), &cookie);
+                }
+
+                fz_drop_display_list(ctx, list);
+            }
+        }
+
+        fz_drop_context(ctx);
+    }
+};
+
+GlyphWarmer::GlyphWarmer(const Document &doc, QMutex *docMutex)
+    : d(new Data(doc, docMutex))
+{
+    fz_context *ctx = doc.cloneContext();
+
+    if (ctx) {
+        d->thread = std::thread(&Data::run, d, ctx);
+    }
+}
+
+GlyphWarmer::~GlyphWarmer()
+{
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->quit = true;
+        d->cookie.abort = 1;
+    }
+    d->wakeup.notify_all();
+
+    if (d->thread.joinable()) {
+        d->thread.join();
+    }
+
+    delete d;
+}
+
+void GlyphWarmer::warm(int page, const QSize &size)
+{
+    if (!d->thread.joinable() || size.isEmpty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->cookie.abort = 1;
+        d->page = page;
+        d->size = size;
+        d->options = d->doc.renderOptions();
+    }
+    d->wakeup.notify_all();
+}
+
+void GlyphWarmer::preempt()
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+
+    if (d->recording) {
+        d->cookie.abort = 1;
+    }
+}
+
+void GlyphWarmer::clear()
+{
+    if (!d->thread.joinable()) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(d->mutex);
+    ++d->generation;
+    d->page = -1;
+    d->cookie.abort = 1;
+    d->wakeup.notify_all();
+    d->wakeup.wait(lock, [this] { return d->dropped == d->generation; });
+}
+
+} // namespace QMuPDF
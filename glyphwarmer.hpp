@@ -0,0 +1,53 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_GLYPHWARMER_HPP
+#define QMUPDF_GLYPHWARMER_HPP
+
+#include <QSize>
+
+class QMutex;
+
+namespace QMuPDF
+{
+
+class Document;
+
+// Rasterizes the glyphs of the first pages of a document into MuPDF's
+// glyph cache, which all contexts of the process share, so that the first
+// render of those pages finds them there. Later pages are left to the
+// prefetcher, which fills the same cache. The glyph cache goes by font
+// objects, so pages are recorded from the document itself, holding
+// docMutex, and their display lists are run on a thread of its own, which
+// doesn't draw anything else.
+class GlyphWarmer
+{
+public:
+    GlyphWarmer(const Document &doc, QMutex *docMutex);
+    ~GlyphWarmer();
+
+    // Warms page and the one after it, at the scale page is shown at size,
+    // instead of whatever is being warmed. Has to be called only while the
+    // document is loaded and nothing changes its render options.
+    void warm(int page, const QSize &size);
+    // Gives up recording a page, for a request waiting for the document
+    void preempt();
+    // Stops warming and forgets the document, has to be called before the
+    // document is closed.
+    void clear();
+
+private:
+    Q_DISABLE_COPY(GlyphWarmer)
+    struct Data;
+    Data *d;
+};
+
+} // namespace QMuPDF
+
+#endif
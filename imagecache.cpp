@@ -0,0 +1,354 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "imagecache.hpp"
+
+#include <cmath>
+
+namespace QMuPDF
+{
+
+// Sizes in bytes
+static const qint64 s_maxCost = 128 * 1024 * 1024;
+static const qint64 s_maxImageCost = 32 * 1024 * 1024;
+
+// Finds the image of a scanned page, stops at anything else that is drawn.
+// Invisible text, like the OCR layer of scans, goes to ignore_text and
+// doesn't count.
+struct ScanDevice {
+    fz_device super;
+    fz_cookie *cookie;
+    fz_image *image;
+    fz_matrix ctm;
+    fz_color_params params;
+    bool other;
+};
+
+static void markOther(fz_device *dev)
+{
+    auto *scan = reinterpret_cast<ScanDevice *>(dev);
+    scan->other = true;
+    scan->cookie->abort = 1;
+}
+
+static void scanFillImage(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha,
+                          fz_color_params params)
+{
+    auto *scan = reinterpret_cast<ScanDevice *>(dev);
+
+    if (scan->image || alpha < 1) {
+        markOther(dev);
+        return;
+    }
+
+    scan->image = fz_keep_image(ctx, image);
+    scan->ctm = ctm;
+    scan->params = params;
+}
+
+static void scanFillPath(fz_context *, fz_device *dev, const fz_path *, int, fz_matrix, fz_colorspace *,
+                         const float *, float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanStrokePath(fz_context *, fz_device *dev, const fz_path *, const fz_stroke_state *, fz_matrix,
+                           fz_colorspace *, const float *, float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanClipPath(fz_context *, fz_device *dev, const fz_path *, int, fz_matrix, fz_rect)
+{
+    markOther(dev);
+}
+
+static void scanClipStrokePath(fz_context *, fz_device *dev, const fz_path *, const fz_stroke_state *, fz_matrix,
+                               fz_rect)
+{
+    markOther(dev);
+}
+
+static void scanFillText(fz_context *, fz_device *dev, const fz_text *, fz_matrix, fz_colorspace *, const float *,
+                         float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanStrokeText(fz_context *, fz_device *dev, const fz_text *, const fz_stroke_state *, fz_matrix,
+                           fz_colorspace *, const float *, float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanClipText(fz_context *, fz_device *dev, const fz_text *, fz_matrix, fz_rect)
+{
+    markOther(dev);
+}
+
+static void scanClipStrokeText(fz_context *, fz_device *dev, const fz_text *, const fz_stroke_state *, fz_matrix,
+                               fz_rect)
+{
+    markOther(dev);
+}
+
+static void scanFillShade(fz_context *, fz_device *dev, fz_shade *, fz_matrix, float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanFillImageMask(fz_context *, fz_device *dev, fz_image *, fz_matrix, fz_colorspace *, const float *,
+                              float, fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanClipImageMask(fz_context *, fz_device *dev, fz_image *, fz_matrix, fz_rect)
+{
+    markOther(dev);
+}
+
+static void scanBeginMask(fz_context *, fz_device *dev, fz_rect, int, fz_colorspace *, const float *,
+                          fz_color_params)
+{
+    markOther(dev);
+}
+
+static void scanBeginGroup(fz_context *, fz_device *dev, fz_rect, fz_colorspace *, int, int, int, float)
+{
+    markOther(dev);
+}
+
+static int scanBeginTile(fz_context *, fz_device *dev, fz_rect, fz_rect, float, float, fz_matrix, int)
+{
+    markOther(dev);
+    return 0;
+}
+
+static ScanDevice *newScanDevice(fz_context *ctx, fz_cookie *cookie)
+{
+    ScanDevice *dev = fz_new_derived_device(ctx, ScanDevice);
+    dev->super.fill_path = scanFillPath;
+    dev->super.stroke_path = scanStrokePath;
+    dev->super.clip_path = scanClipPath;
+    dev->super.clip_stroke_path = scanClipStrokePath;
+    dev->super.fill_text = scanFillText;
+    dev->super.stroke_text = scanStrokeText;
+    dev->super.clip_text = scanClipText;
+    dev->super.clip_stroke_text = scanClipStrokeText;
+    dev->super.fill_shade = scanFillShade;
+    dev->super.fill_image = scanFillImage;
+    dev->super.fill_image_mask = scanFillImageMask;
+    dev->super.clip_image_mask = scanClipImageMask;
+    dev->super.begin_mask = scanBeginMask;
+    dev->super.begin_group = scanBeginGroup;
+    dev->super.begin_tile = scanBeginTile;
+    dev->cookie = cookie;
+    dev->image = nullptr;
+    dev->other = false;
+    return dev;
+}
+
+// Returns the image of a scanned page, which the caller has to drop, and
+// where it is drawn in page space, or nullptr for any other page.
+template<typename Run>
+static fz_image *findScan(fz_context *ctx, Run run, fz_matrix *ctm, fz_color_params *params)
+{
+    fz_cookie cookie = { 0, 0, 0, 0, 0 };
+    ScanDevice *dev = nullptr;
+    fz_image *image = nullptr;
+    fz_var(dev);
+    fz_var(image);
+
+    fz_try(ctx) {
+        dev = newScanDevice(ctx, &cookie);
+        run(&dev->super, &cookie);
+        fz_close_device(ctx, &dev->super);
+
+        // Parts of a progressively loaded page may be missing
+        if (!dev->other && !cookie.errors && !cookie.incomplete) {
+            image = dev->image;
+            dev->image = nullptr;
+            *ctm = dev->ctm;
+            *params = dev->params;
+        }
+    }
+    fz_always(ctx) {
+        if (dev) {
+            fz_drop_image(ctx, dev->image);
+            fz_drop_device(ctx, &dev->super);
+        }
+    }
+    fz_catch(ctx) {
+        fz_drop_image(ctx, image);
+        return nullptr;
+    }
+
+    return image;
+}
+
+ImageCache::ImageCache()
+    : m_cost(0)
+{
+}
+
+ImageCache::~ImageCache()
+{
+    Q_ASSERT(m_entries.empty());
+}
+
+bool ImageCache::render(fz_context *ctx, fz_page *page, const fz_matrix &ctm, fz_pixmap *dest)
+{
+    fz_matrix imageCtm;
+    fz_color_params params;
+    fz_image *image = findScan(ctx, [ctx, page](fz_device *dev, fz_cookie *cookie) {
+        fz_run_page(ctx, page, dev, fz_identity, cookie);
+    }, &imageCtm, &params);
+
+    const bool ok = image && paint(ctx, image, fz_concat(imageCtm, ctm), params, dest);
+    fz_drop_image(ctx, image);
+    return ok;
+}
+
+bool ImageCache::render(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, fz_pixmap *dest)
+{
+    fz_matrix imageCtm;
+    fz_color_params params;
+    fz_image *image = findScan(ctx, [ctx, list](fz_device *dev, fz_cookie *cookie) {
+        fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, cookie);
+    }, &imageCtm, &params);
+
+    const bool ok = image && paint(ctx, image, fz_concat(imageCtm, ctm), params, dest);
+    fz_drop_image(ctx, image);
+    return ok;
+}
+
+void ImageCache::clear(fz_context *ctx)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (const Entry &entry : m_entries) {
+        fz_drop_pixmap(ctx, entry.pixmap);
+        fz_drop_image(ctx, entry.image);
+    }
+
+    m_entries.clear();
+    m_cost = 0;
+}
+
+bool ImageCache::paint(fz_context *ctx, fz_image *image, const fz_matrix &ctm, fz_color_params params,
+                       fz_pixmap *dest)
+{
+    // Scans are drawn upright, anything else is left to the draw device
+    if (ctm.b != 0 || ctm.c != 0 || ctm.a <= 0 || ctm.d <= 0 || image->mask) {
+        return false;
+    }
+
+    fz_pixmap *source = decoded(ctx, image, ctm.a, ctm.d);
+
+    if (!source) {
+        return false;
+    }
+
+    const fz_irect clip = fz_pixmap_bbox(ctx, dest);
+    fz_pixmap *scaled = nullptr;
+    fz_image *visible = nullptr;
+    fz_device *device = nullptr;
+    fz_var(scaled);
+    fz_var(visible);
+    fz_var(device);
+
+    // Only the part inside dest is scaled, then drawn one to one, so that
+    // the draw device still converts colours like it would have.
+    fz_try(ctx) {
+        scaled = fz_scale_pixmap(ctx, source, ctm.e, ctm.f, ctm.a, ctm.d, &clip);
+
+        if (scaled) {
+            visible = fz_new_image_from_pixmap(ctx, scaled, nullptr);
+            device = fz_new_draw_device(ctx, fz_identity, dest);
+            fz_fill_image(ctx, device, visible,
+                          fz_make_matrix(fz_pixmap_width(ctx, scaled), 0, 0, fz_pixmap_height(ctx, scaled),
+                                         fz_pixmap_x(ctx, scaled), fz_pixmap_y(ctx, scaled)),
+                          1, params);
+            fz_close_device(ctx, device);
+        }
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+        fz_drop_image(ctx, visible);
+        fz_drop_pixmap(ctx, scaled);
+        fz_drop_pixmap(ctx, source);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
+
+    return true;
+}
+
+fz_pixmap *ImageCache::decoded(fz_context *ctx, fz_image *image, float width, float height)
+{
+    // Same choice as MuPDF's draw device: subsample as long as the result
+    // stays larger than what is drawn
+    int l2factor = 0;
+
+    while (l2factor < 6 && (image->w >> (l2factor + 1)) >= width + 2
+           && (image->h >> (l2factor + 1)) >= height + 2) {
+        ++l2factor;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->image == image && it->l2factor == l2factor) {
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                return fz_keep_pixmap(ctx, it->pixmap);
+            }
+        }
+    }
+
+    // One more component for a possible alpha channel
+    const qint64 cost = qint64(image->w >> l2factor) * (image->h >> l2factor) * (image->n + 1);
+
+    if (cost > s_maxImageCost) {
+        return nullptr;
+    }
+
+    fz_pixmap *pixmap = nullptr;
+    fz_var(pixmap);
+
+    fz_try(ctx) {
+        fz_matrix ctm = fz_scale(width, height);
+        int w = std::ceil(width);
+        int h = std::ceil(height);
+        pixmap = fz_get_pixmap_from_image(ctx, image, nullptr, &ctm, &w, &h);
+    }
+    fz_catch(ctx) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Another thread may have decoded it meanwhile, keeping both is harmless
+    m_entries.push_front({fz_keep_image(ctx, image), l2factor, fz_keep_pixmap(ctx, pixmap), cost});
+    m_cost += cost;
+
+    while (m_cost > s_maxCost && m_entries.size() > 1) {
+        const Entry &last = m_entries.back();
+        m_cost -= last.cost;
+        fz_drop_pixmap(ctx, last.pixmap);
+        fz_drop_image(ctx, last.image);
+        m_entries.pop_back();
+    }
+
+    return pixmap;
+}
+
+} // namespace QMuPDF
@@ -0,0 +1,64 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_IMAGECACHE_HPP
+#define QMUPDF_IMAGECACHE_HPP
+
+extern "C" {
+#include <mupdf/fitz.h>
+}
+
+#include <QtGlobal>
+
+#include <list>
+#include <mutex>
+
+namespace QMuPDF
+{
+
+// Renders scanned pages, whose only visible content is one image, from
+// decodes kept per image and power-of-two subsampling level (l2factor).
+// MuPDF chooses the same level when drawing, but its store only finds a
+// decode again for the same visible area and evicts the large ones early.
+// Images too large to keep are left to the draw device, which decodes only
+// the visible area. Can be used from several threads.
+class ImageCache
+{
+public:
+    ImageCache();
+    ~ImageCache();
+
+    // Paints page at ctm into dest, which has to be cleared to white.
+    // Returns false if page is not a scanned page, dest then has to be
+    // rendered as usual.
+    bool render(fz_context *ctx, fz_page *page, const fz_matrix &ctm, fz_pixmap *dest);
+    bool render(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, fz_pixmap *dest);
+    // Has to be called before the contexts of the document are dropped
+    void clear(fz_context *ctx);
+
+private:
+    Q_DISABLE_COPY(ImageCache)
+    struct Entry {
+        fz_image *image;
+        int l2factor;
+        fz_pixmap *pixmap;
+        qint64 cost;
+    };
+    bool paint(fz_context *ctx, fz_image *image, const fz_matrix &ctm, fz_color_params params, fz_pixmap *dest);
+    fz_pixmap *decoded(fz_context *ctx, fz_image *image, float width, float height);
+
+    std::mutex m_mutex;
+    // Most recently used first
+    std::list<Entry> m_entries;
+    qint64 m_cost;
+};
+
+} // namespace QMuPDF
+
+#endif
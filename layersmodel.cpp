@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "layersmodel.hpp"
+
+namespace QMuPDF
+{
+
+static Qt::CheckState checkState(const Document::Layer &layer)
+{
+    return layer.visible ? Qt::Checked : Qt::Unchecked;
+}
+
+LayersModel::LayersModel(const QVector<Document::Layer> &layers, const Toggle &toggle, QObject *parent)
+    : QStandardItemModel(parent)
+    , m_toggle(toggle)
+{
+    // The last item at each depth, which the deeper ones are children of
+    QVector<QStandardItem *> parents;
+
+    for (const Document::Layer &layer : layers) {
+        QStandardItem *item = new QStandardItem(layer.text);
+        item->setEditable(false);
+
+        if (layer.type != Document::Layer::Label) {
+            item->setCheckable(!layer.locked);
+            item->setCheckState(checkState(layer));
+        }
+
+        parents.resize(qBound(0, layer.depth, parents.size()));
+        (parents.isEmpty() ? invisibleRootItem() : parents.last())->appendRow(item);
+        parents.append(item);
+        m_items.append(item);
+    }
+}
+
+bool LayersModel::setData(const QModelIndex &index, const QVariant &value, int role)
+{
+    const int layer = m_items.indexOf(itemFromIndex(index));
+
+    if (role != Qt::CheckStateRole || layer < 0) {
+        return QStandardItemModel::setData(index, value, role);
+    }
+
+    // The document changes first, as views reload the pages as soon as the
+    // check state of an item does. Showing a radio box hides the others of
+    // its group, which are updated as well.
+    const Qt::CheckState previous = m_items.at(layer)->checkState();
+    const QVector<Document::Layer> layers = m_toggle(layer, value.toInt() == Qt::Checked);
+
+    for (int i = 0; i < layers.size() && i < m_items.size(); ++i) {
+        QStandardItem *item = m_items.at(i);
+
+        if (layers.at(i).type != Document::Layer::Label && item->checkState() != checkState(layers.at(i))) {
+            item->setCheckState(checkState(layers.at(i)));
+        }
+    }
+
+    // Locked layers and failures to change them leave everything as it was
+    return m_items.at(layer)->checkState() != previous;
+}
+
+} // namespace QMuPDF
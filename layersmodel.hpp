@@ -0,0 +1,44 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_LAYERSMODEL_HPP
+#define QMUPDF_LAYERSMODEL_HPP
+
+#include "document.hpp"
+
+#include <QStandardItemModel>
+
+#include <functional>
+
+namespace QMuPDF
+{
+
+// The layer panel of a document for Okular's layers view, which reloads
+// the pages whenever check states change here.
+class LayersModel : public QStandardItemModel
+{
+public:
+    // Shows or hides the layer at index in the layers of the document and
+    // returns them as they are afterwards
+    using Toggle = std::function<QVector<Document::Layer>(int index, bool visible)>;
+
+    LayersModel(const QVector<Document::Layer> &layers, const Toggle &toggle, QObject *parent = nullptr);
+
+    bool setData(const QModelIndex &index, const QVariant &value, int role = Qt::EditRole) override;
+
+private:
+    Q_DISABLE_COPY(LayersModel)
+    Toggle m_toggle;
+    // By index in the layers of the document
+    QVector<QStandardItem *> m_items;
+};
+
+} // namespace QMuPDF
+
+#endif
@@ -8,18 +8,31 @@
  ***************************************************************************/
 
 #include "page.hpp"
+#include "displaylistcache.hpp"
+#include "imagecache.hpp"
 
 extern "C" {
 #include <mupdf/fitz.h>
 }
 
-#include <QDebug>
 #include <QImage>
 #include <QSharedData>
+#include <QThread>
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <vector>
 
 namespace QMuPDF
 {
 
+// Renders with more pixels than this are split into bands of s_bandHeight
+// rows, which all cores rasterize
+static const qint64 s_bandedPixels = 4 * 1024 * 1024;
+static const int s_bandHeight = 256;
+
 QRectF convert_fz_rect(const fz_rect &rect, const QSizeF &dpi)
 {
     const float scaleX = dpi.width() / 72.;
@@ -29,47 +42,302 @@ QRectF convert_fz_rect(const fz_rect &rect, const QSizeF &dpi)
     return QRectF(topLeft, bottomRight);
 }
 
-QImage convert_fz_pixmap(fz_context *ctx, fz_pixmap *image)
+// Opaque images only, as pages are drawn onto white. Gray pages take a
+// byte per pixel.
+static QImage newImage(const QSize &size, bool gray, const Page::Allocator &allocate)
+{
+    const QImage::Format format = gray ? QImage::Format_Grayscale8 : QImage::Format_RGB888;
+    return allocate ? allocate(size, format) : QImage(size, format);
+}
+
+// Whether list only draws in shades of gray. Images count as colour unless
+// their colour space is gray, as looking at their pixels means decoding
+// them.
+static bool isGray(fz_context *ctx, fz_display_list *list)
 {
-    const int w = fz_pixmap_width(ctx, image);
-    const int h = fz_pixmap_height(ctx, image);
-    QImage img(w, h, QImage::Format_RGBA8888);
+    int color = 0;
+    fz_device *device = nullptr;
+    fz_var(device);
+
+    // The test device throws as soon as it finds colour
+    fz_try(ctx) {
+        device = fz_new_test_device(ctx, &color, 0.02f, 0, nullptr);
+        fz_run_display_list(ctx, list, device, fz_identity, fz_infinite_rect, nullptr);
+        fz_close_device(ctx, device);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
 
-    if (img.bytesPerLine() == fz_pixmap_stride(ctx, image)) {
-        memcpy(img.bits(), fz_pixmap_samples(ctx, image), img.sizeInBytes());
-    } else {
-        qWarning() << "QImage line stride" << img.bytesPerLine() << "doesn't match" << fz_pixmap_stride(ctx, image);
-        QRgb *data = reinterpret_cast<QRgb *>(fz_pixmap_samples(ctx, image));
+    return !color;
+}
 
-        for (int i = 0; i < h; ++i) {
-            QRgb *imgdata = reinterpret_cast<QRgb *>(img.scanLine(h));
+static fz_page *loadPage(fz_context *ctx, fz_document *doc, int num)
+{
+    fz_page *page = nullptr;
+    fz_var(page);
 
-            for (int j = 0; j < w; ++j) {
-                *imgdata = *data;
-                data++;
-                imgdata++;
-            }
+    // Fails with FZ_ERROR_TRYLATER for pages of a progressively loaded
+    // document that haven't arrived yet
+    fz_try(ctx) {
+        page = fz_load_page(ctx, doc, num);
+    }
+    fz_catch(ctx) {
+        return nullptr;
+    }
+
+    return page;
+}
+
+// Renders into CMYK plus the spot colours of the page, so that the draw
+// device simulates overprinting, and converts the result to RGB.
+static QImage renderOverprint(fz_context *ctx, fz_page *page, const fz_matrix &ctm, int width, int height,
+                              fz_cookie *cookie, const Page::Allocator &allocate)
+{
+    fz_separations *seps = nullptr;
+    fz_pixmap *cmyk = nullptr;
+    fz_pixmap *rgb = nullptr;
+    fz_device *device = nullptr;
+    fz_var(seps);
+    fz_var(cmyk);
+    fz_var(rgb);
+    fz_var(device);
+
+    fz_try(ctx) {
+        seps = fz_page_separations(ctx, page);
+
+        for (int i = 0; seps && i < fz_count_separations(ctx, seps); ++i) {
+            fz_set_separation_behavior(ctx, seps, i, FZ_SEPARATION_SPOT);
         }
+
+        cmyk = fz_new_pixmap(ctx, fz_device_cmyk(ctx), width, height, seps, 0);
+        fz_clear_pixmap(ctx, cmyk);
+        device = fz_new_draw_device(ctx, fz_identity, cmyk);
+        fz_run_page(ctx, page, device, ctm, cookie);
+        fz_close_device(ctx, device);
+        rgb = fz_clone_pixmap_area_with_different_seps(ctx, cmyk, nullptr, fz_device_rgb(ctx), nullptr,
+                                                        fz_default_color_params, nullptr);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+        fz_drop_pixmap(ctx, cmyk);
+        fz_drop_separations(ctx, seps);
+    }
+    fz_catch(ctx) {
+        fz_drop_pixmap(ctx, rgb);
+        return QImage();
+    }
+
+    QImage img;
+
+    if (!cookie->errors) {
+        img = newImage(QSize(fz_pixmap_width(ctx, rgb), fz_pixmap_height(ctx, rgb)), false, allocate);
     }
 
+    for (int y = 0; y < img.height(); ++y) {
+        memcpy(img.scanLine(y), fz_pixmap_samples(ctx, rgb) + qsizetype(y) * fz_pixmap_stride(ctx, rgb),
+               img.width() * 3);
+    }
+
+    fz_drop_pixmap(ctx, rgb);
     return img;
 }
 
+// Returns a pixmap of rows y to y + height of img, one of newImage(),
+// cleared to white, which draws directly into img, or nullptr. bits are
+// those of img, which are taken once as QImage::bits() may detach.
+static fz_pixmap *wrapRows(fz_context *ctx, const QImage &img, uchar *bits, int y, int height)
+{
+    fz_pixmap *pixmap = nullptr;
+    fz_var(pixmap);
+
+    fz_try(ctx) {
+        fz_colorspace *csp = img.format() == QImage::Format_Grayscale8 ? fz_device_gray(ctx) : fz_device_rgb(ctx);
+        pixmap = fz_new_pixmap_with_data(ctx, csp, img.width(), height, nullptr, 0,
+                                         img.bytesPerLine(), bits + qsizetype(y) * img.bytesPerLine());
+        fz_clear_pixmap_with_value(ctx, pixmap, 0xff);
+    }
+    fz_catch(ctx) {
+        return nullptr;
+    }
+
+    return pixmap;
+}
+
+static bool renderBand(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, const QImage &img,
+                       uchar *bits, int y)
+{
+    const int height = qMin(s_bandHeight, img.height() - y);
+    fz_pixmap *band = wrapRows(ctx, img, bits, y, height);
+    fz_device *device = nullptr;
+    fz_cookie cookie = { 0, 0, 0, 0, 0 };
+    fz_var(device);
+
+    if (!band) {
+        return false;
+    }
+
+    // Scratch pixmaps of the draw device are bounded by the band
+    fz_try(ctx) {
+        device = fz_new_draw_device(ctx, fz_identity, band);
+        fz_run_display_list(ctx, list, device, fz_concat(ctm, fz_translate(0, -y)),
+                            fz_make_rect(0, 0, img.width(), height), &cookie);
+        fz_close_device(ctx, device);
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+        fz_drop_pixmap(ctx, band);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
+
+    return !cookie.errors;
+}
+
+// Rasterizes list at ctm into img, one of newImage(), in bands taken in
+// turn by this thread and threads on contexts cloned from ctx, which are
+// set up for options like ctx. Scanned pages are drawn at once from their
+// decoded image instead.
+static QImage renderBanded(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, QImage img,
+                           const RenderOptions &options, ImageCache *images)
+{
+    if (img.isNull()) {
+        return img;
+    }
+
+    uchar *bits = img.bits();
+
+    if (images) {
+        fz_pixmap *dest = wrapRows(ctx, img, bits, 0, img.height());
+        const bool scanned = dest && images->render(ctx, list, ctm, dest);
+        fz_drop_pixmap(ctx, dest);
+
+        if (scanned) {
+            return img;
+        }
+    }
+
+    const int bandCount = (img.height() + s_bandHeight - 1) / s_bandHeight;
+    std::atomic<int> nextBand(0);
+    std::atomic<bool> failed(false);
+    auto work = [&](fz_context *bandCtx) {
+        for (int band = nextBand++; band < bandCount && !failed; band = nextBand++) {
+            if (!renderBand(bandCtx, list, ctm, img, bits, band * s_bandHeight)) {
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<fz_context *> contexts;
+
+    for (int i = 1; i < qMin(QThread::idealThreadCount(), bandCount); ++i) {
+        fz_context *bandCtx = fz_clone_context(ctx);
+
+        if (!bandCtx) {
+            break;
+        }
+
+        // Cloned contexts start out with ICC enabled
+        options.apply(bandCtx);
+        contexts.push_back(bandCtx);
+        threads.emplace_back(work, bandCtx);
+    }
+
+    work(ctx);
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    for (fz_context *bandCtx : contexts) {
+        fz_drop_context(bandCtx);
+    }
+
+    return failed ? QImage() : img;
+}
+
+// Rasterizes list at ctm into img, one of newImage(), on this thread
+static QImage renderList(fz_context *ctx, fz_display_list *list, const fz_matrix &ctm, QImage img,
+                         fz_cookie *cookie, ImageCache *images)
+{
+    if (img.isNull()) {
+        return img;
+    }
+
+    fz_pixmap *pixmap = wrapRows(ctx, img, img.bits(), 0, img.height());
+    fz_device *device = nullptr;
+    fz_var(device);
+
+    if (!pixmap) {
+        return QImage();
+    }
+
+    fz_try(ctx) {
+        if (!images || !images->render(ctx, list, ctm, pixmap)) {
+            device = fz_new_draw_device(ctx, fz_identity, pixmap);
+            fz_run_display_list(ctx, list, device, ctm, fz_infinite_rect, cookie);
+            fz_close_device(ctx, device);
+        }
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, device);
+        fz_drop_pixmap(ctx, pixmap);
+    }
+    fz_catch(ctx) {
+        return QImage();
+    }
+
+    return cookie->abort || cookie->errors ? QImage() : img;
+}
+
+bool GrayPages::find(int page, bool *gray) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_pages.constFind(page);
+
+    if (it == m_pages.constEnd()) {
+        return false;
+    }
+
+    *gray = *it;
+    return true;
+}
+
+void GrayPages::insert(int page, bool gray)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pages.insert(page, gray);
+}
+
+void GrayPages::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pages.clear();
+}
+
 struct Page::Data : public QSharedData {
-    Data(int pageNum, fz_context *ctx, fz_document *doc, fz_page *page) : pageNum{pageNum}, ctx{ctx}, doc{doc}, page{page} {}
+    Data(int pageNum, fz_context *ctx, fz_document *doc, fz_page *page, const RenderOptions &options, ImageCache *images, DisplayListCache *lists, GrayPages *grayPages) : pageNum{pageNum}, ctx{ctx}, doc{doc}, page{page}, options{options}, images{images}, lists{lists}, grayPages{grayPages} {}
+    ~Data() { fz_drop_page(ctx, page); }
     int pageNum;
     fz_context *ctx;
     fz_document *doc;
     fz_page *page;
+    RenderOptions options;
+    ImageCache *images;
+    DisplayListCache *lists;
+    GrayPages *grayPages;
 };
 
-Page::~Page()
-{
-    fz_drop_page(d->ctx, d->page);
-}
+Page::~Page() = default;
 
-Page::Page(fz_context *ctx, fz_document *doc, int num) :
-    d(new Page::Data(num, ctx, doc, fz_load_page(ctx, doc, num)))
+Page::Page(fz_context *ctx, fz_document *doc, int num, const RenderOptions &options, ImageCache *images,
+           DisplayListCache *lists, GrayPages *grayPages) :
+    d(new Page::Data(num, ctx, doc, loadPage(ctx, doc, num), options, images, lists, grayPages))
 {
     Q_ASSERT(doc && ctx);
 }
@@ -81,8 +349,17 @@ int Page::number() const
     return d->pageNum;
 }
 
+bool Page::isValid() const
+{
+    return d->page;
+}
+
 QSizeF Page::size(const QSizeF &dpi) const
 {
+    if (!d->page) {
+        return QSizeF();
+    }
+
     fz_rect rect = fz_bound_page(d->ctx, d->page);
     // MuPDF always assumes 72dpi
     return QSizeF((rect.x1 - rect.x0) * dpi.width() / 72.,
@@ -91,35 +368,211 @@ QSizeF Page::size(const QSizeF &dpi) const
 
 qreal Page::duration() const
 {
-    float val;
+    float val = 0;
+
+    if (!d->page) {
+        return -1;
+    }
+
     (void)fz_page_presentation(d->ctx, d->page, nullptr, &val);
     return val < 0.1 ? -1 : val;
 }
 
-QImage Page::render(qreal width, qreal height) const
+QImage Page::render(qreal width, qreal height, const QRect &tile, bool *incomplete, const Allocator &allocate) const
 {
+    if (incomplete) {
+        *incomplete = !d->page;
+    }
+
+    if (!d->page) {
+        return QImage();
+    }
+
     const QSizeF s = size(QSizeF(72, 72));
-    fz_matrix ctm = fz_scale(width / s.width(), height / s.height());
+    const QRect area = tile.isNull() ? QRect(0, 0, width, height) : tile;
+    const fz_matrix ctm = fz_concat(fz_scale(width / s.width(), height / s.height()), fz_translate(-area.x(), -area.y()));
     fz_cookie cookie = { 0, 0, 0, 0, 0 };
-    fz_colorspace *csp = fz_device_rgb(d->ctx);
-    fz_pixmap *image = fz_new_pixmap(d->ctx, csp, width, height, nullptr, 1);
-    fz_clear_pixmap_with_value(d->ctx, image, 0xff);
-    fz_device *device = fz_new_draw_device(d->ctx, fz_identity, image);
-    fz_run_page(d->ctx, d->page, device, ctm, &cookie);
-    fz_close_device(d->ctx, device);
-    fz_drop_device(d->ctx, device);
-    QImage img;
 
-    if (!cookie.errors) {
-        img = convert_fz_pixmap(d->ctx, image);
+    if (simulatesOverprint()) {
+        const QImage img = renderOverprint(d->ctx, d->page, ctm, area.width(), area.height(), &cookie, allocate);
+
+        if (!img.isNull()) {
+            if (incomplete) {
+                *incomplete = cookie.incomplete;
+            }
+
+            return img;
+        }
+
+        cookie = { 0, 0, 0, 0, 0 };
     }
 
-    fz_drop_pixmap(d->ctx, image);
-    return img;
+    // A single large page, e.g. a schematic, is recorded once and then
+    // rasterized by all cores. Pages with layers are recorded once per
+    // configuration of them, so that showing or hiding layers only
+    // rasterizes them again. Pages are recorded as well when first
+    // rendered, to find out whether they are gray. displayList() fails for
+    // incomplete pages, which are left to the usual rendering below.
+    bool gray = false;
+    const bool known = d->grayPages && d->grayPages->find(d->pageNum, &gray);
+    const bool banded = qint64(area.width()) * area.height() > s_bandedPixels && QThread::idealThreadCount() > 1;
+    fz_display_list *list = d->lists ? d->lists->find(d->ctx, d->pageNum) : nullptr;
+
+    if (!list && (banded || d->lists || (d->grayPages && !known))) {
+        list = displayList(&cookie);
+        cookie = { 0, 0, 0, 0, 0 };
+
+        if (list && d->lists) {
+            d->lists->insert(d->ctx, d->pageNum, list);
+        }
+    }
+
+    if (list) {
+        if (d->grayPages && !known) {
+            gray = isGray(d->ctx, list);
+            d->grayPages->insert(d->pageNum, gray);
+        }
+
+        // Handed over without a copy, which would detach from allocate's pixels
+        const QImage img = banded
+            ? renderBanded(d->ctx, list, ctm, newImage(area.size(), gray, allocate), d->options, d->images)
+            : renderList(d->ctx, list, ctm, newImage(area.size(), gray, allocate), &cookie, d->images);
+        fz_drop_display_list(d->ctx, list);
+
+        if (!img.isNull()) {
+            return img;
+        }
+
+        cookie = { 0, 0, 0, 0, 0 };
+    }
+
+    QImage img = newImage(area.size(), gray, allocate);
+
+    if (img.isNull()) {
+        return img;
+    }
+
+    fz_pixmap *image = wrapRows(d->ctx, img, img.bits(), 0, img.height());
+    fz_device *device = nullptr;
+    fz_var(device);
+
+    if (!image) {
+        return QImage();
+    }
+
+    fz_try(d->ctx) {
+        if (!d->images || !d->images->render(d->ctx, d->page, ctm, image)) {
+            device = fz_new_draw_device(d->ctx, fz_identity, image);
+            fz_run_page(d->ctx, d->page, device, ctm, &cookie);
+            fz_close_device(d->ctx, device);
+        }
+    }
+    fz_always(d->ctx) {
+        fz_drop_device(d->ctx, device);
+        fz_drop_pixmap(d->ctx, image);
+    }
+    fz_catch(d->ctx) {
+        return QImage();
+    }
+
+    // Resources of a progressively loaded document may still be missing
+    if (incomplete) {
+        *incomplete = cookie.incomplete;
+    }
+
+    return cookie.errors ? QImage() : img;
+}
+
+bool Page::simulatesOverprint() const
+{
+    return d->page && d->options.overprint && fz_page_uses_overprint(d->ctx, d->page);
+}
+
+fz_display_list *Page::displayList(fz_cookie *cookie) const
+{
+    fz_display_list *list = nullptr;
+    fz_device *device = nullptr;
+
+    if (!d->page) {
+        return nullptr;
+    }
+
+    fz_var(list);
+    fz_var(device);
+
+    fz_try(d->ctx) {
+        list = fz_new_display_list(d->ctx, fz_bound_page(d->ctx, d->page));
+        device = fz_new_list_device(d->ctx, list);
+        fz_run_page(d->ctx, d->page, device, fz_identity, cookie);
+        fz_close_device(d->ctx, device);
+    }
+    fz_always(d->ctx) {
+        fz_drop_device(d->ctx, device);
+    }
+    fz_catch(d->ctx) {
+        fz_drop_display_list(d->ctx, list);
+        return nullptr;
+    }
+
+    if (cookie && (cookie->abort || cookie->errors || cookie->incomplete)) {
+        fz_drop_display_list(d->ctx, list);
+        return nullptr;
+    }
+
+    return list;
+}
+
+QImage Page::render(fz_context *ctx, fz_display_list *list, qreal width, qreal height,
+                    fz_cookie *cookie, ImageCache *images, GrayPages *grayPages, int number)
+{
+    const fz_rect bounds = fz_bound_display_list(ctx, list);
+    const fz_matrix ctm = fz_scale(width / (bounds.x1 - bounds.x0), height / (bounds.y1 - bounds.y0));
+    fz_cookie localCookie = { 0, 0, 0, 0, 0 };
+
+    if (!cookie) {
+        cookie = &localCookie;
+    }
+
+    bool gray = false;
+
+    if (grayPages && !grayPages->find(number, &gray)) {
+        gray = isGray(ctx, list);
+        grayPages->insert(number, gray);
+    }
+
+    return renderList(ctx, list, ctm, newImage(QSize(width, height), gray, nullptr), cookie, images);
+}
+
+QImage Page::renderDraft(fz_context *ctx, fz_display_list *list, qreal width, qreal height,
+                         fz_cookie *cookie)
+{
+    // About a quarter megapixel is rasterized in a few milliseconds
+    const qreal scale = std::sqrt(262144. / (width * height));
+
+    if (scale > 0.5) {
+        return QImage();
+    }
+
+    const int textAA = fz_text_aa_level(ctx);
+    const int graphicsAA = fz_graphics_aa_level(ctx);
+    fz_set_aa_level(ctx, 0);
+    const QImage draft = render(ctx, list, qMax(1., width * scale), qMax(1., height * scale), cookie);
+    fz_set_text_aa_level(ctx, textAA);
+    fz_set_graphics_aa_level(ctx, graphicsAA);
+
+    if (draft.isNull()) {
+        return draft;
+    }
+
+    return draft.scaled(width, height, Qt::IgnoreAspectRatio, Qt::FastTransformation);
 }
 
 QVector<TextBox *> Page::textBoxes(const QSizeF &dpi) const
 {
+    if (!d->page) {
+        return QVector<TextBox *>();
+    }
+
     fz_cookie cookie = {0, 0, 0, 0, 0};
     fz_stext_page *page = fz_new_stext_page(d->ctx, fz_empty_rect);
     fz_stext_options options{};
@@ -160,9 +613,50 @@ QVector<TextBox *> Page::textBoxes(const QSizeF &dpi) const
     return boxes;
 }
 
+QString Page::text() const
+{
+    if (!d->page) {
+        return QString();
+    }
+
+    fz_stext_page *page = nullptr;
+    fz_device *device = nullptr;
+    fz_buffer *buffer = nullptr;
+    fz_var(page);
+    fz_var(device);
+    fz_var(buffer);
+
+    fz_try(d->ctx) {
+        fz_stext_options options{};
+        page = fz_new_stext_page(d->ctx, fz_bound_page(d->ctx, d->page));
+        device = fz_new_stext_device(d->ctx, page, &options);
+        fz_run_page(d->ctx, d->page, device, fz_identity, nullptr);
+        fz_close_device(d->ctx, device);
+        buffer = fz_new_buffer_from_stext_page(d->ctx, page);
+    }
+    fz_always(d->ctx) {
+        fz_drop_device(d->ctx, device);
+        fz_drop_stext_page(d->ctx, page);
+    }
+    fz_catch(d->ctx) {
+        return QString();
+    }
+
+    unsigned char *data = nullptr;
+    const size_t len = fz_buffer_storage(d->ctx, buffer, &data);
+    const QString text = QString::fromUtf8(reinterpret_cast<const char *>(data), len);
+    fz_drop_buffer(d->ctx, buffer);
+    return text;
+}
+
 QVector<Link> Page::links(const QSizeF &dpi) const
 {
     QVector<Link> ret;
+
+    if (!d->page) {
+        return ret;
+    }
+
     const auto deleter = [this](fz_link* link) { fz_drop_link(d->ctx, link); };
     std::unique_ptr<fz_link, decltype(deleter)> links{fz_load_links(d->ctx, d->page), deleter};
 
@@ -10,19 +10,28 @@
 #ifndef QMUPDF_PAGE_HPP
 #define QMUPDF_PAGE_HPP
 
+#include "document.hpp"
+
+extern "C" {
+#include <mupdf/fitz.h>
+}
+
+#include <QHash>
+#include <QImage>
 #include <QRect>
 #include <QString>
 #include <QSharedDataPointer>
 
-class QImage;
-class QSizeF;
+#include <functional>
+#include <mutex>
 
-struct fz_document;
-struct fz_context;
+class QSizeF;
 
 namespace QMuPDF
 {
 
+class DisplayListCache;
+class ImageCache;
 class TextBox;
 
 struct Link
@@ -38,18 +47,68 @@ struct Link
   Link(int page, qreal x, qreal y, const QRectF& rect) noexcept : external{false}, page{page}, x{x}, y{y}, rect{rect} {}
 };
 
+// Remembers which pages of a document only draw in shades of gray, found
+// out when they are first rendered. Can be used from several threads.
+class GrayPages
+{
+public:
+    // Returns false if page wasn't looked at yet
+    bool find(int page, bool *gray) const;
+    void insert(int page, bool gray);
+    void clear();
+
+private:
+    mutable std::mutex m_mutex;
+    QHash<int, bool> m_pages;
+};
+
 class Page
 {
 public:
-    Page(fz_context *ctx, fz_document *doc, int num);
+    // Renders with options, which ctx has to be set up for already.
+    // Scanned pages are rendered through images if given, and all pages
+    // through display lists kept in lists if given. Gray pages are rendered
+    // into 8-bit images if grayPages is given.
+    Page(fz_context *ctx, fz_document *doc, int num, const RenderOptions &options = RenderOptions(),
+         ImageCache *images = nullptr, DisplayListCache *lists = nullptr, GrayPages *grayPages = nullptr);
     Page(const Page &other);
 
     ~Page();
     int number() const;
+    // Whether the page could be loaded, which may not yet be the case
+    // for a progressively loaded document
+    bool isValid() const;
     QSizeF size(const QSizeF &dpi) const;
     qreal duration() const;
-    QImage render(qreal width, qreal height) const;
+    // Returns an image of size and format for render() to draw into, e.g.
+    // one in shared memory, or a null image
+    using Allocator = std::function<QImage(const QSize &size, QImage::Format format)>;
+
+    // Renders the page at width x height, or only the part of it in tile,
+    // into an opaque RGB888 or Grayscale8 image, taken from allocate if
+    // given. incomplete is set if parts of the page haven't arrived yet.
+    QImage render(qreal width, qreal height, const QRect &tile = QRect(), bool *incomplete = nullptr,
+                  const Allocator &allocate = nullptr) const;
+    // Whether render() simulates overprinting on this page, which the
+    // static render() of its display list doesn't
+    bool simulatesOverprint() const;
+    // Records the page contents, the returned list has to be dropped by the
+    // caller and can be rendered from any context cloned from the document's.
+    fz_display_list *displayList(fz_cookie *cookie = nullptr) const;
+    // Renders list, recorded from page number, like render(). It goes into
+    // an 8-bit image if grayPages is given and has it as gray, or if list
+    // turns out to be gray, which is added to grayPages.
+    static QImage render(fz_context *ctx, fz_display_list *list, qreal width, qreal height,
+                         fz_cookie *cookie = nullptr, ImageCache *images = nullptr,
+                         GrayPages *grayPages = nullptr, int number = -1);
+    // Quick preview of list for progressive rendering, rasterized at a low
+    // resolution without anti-aliasing and scaled up to width x height.
+    // Returns a null image if the page is small enough to not need one.
+    static QImage renderDraft(fz_context *ctx, fz_display_list *list, qreal width, qreal height,
+                              fz_cookie *cookie = nullptr);
     QVector<TextBox *> textBoxes(const QSizeF &dpi) const;
+    // Plain text in reading order, lines separated by newlines
+    QString text() const;
     QVector<Link> links(const QSizeF &dpi) const;
 
 private:
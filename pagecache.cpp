@@ -0,0 +1,215 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "pagecache.hpp"
+
+namespace QMuPDF
+{
+
+// Cache size in KiB
+static const int s_cacheCost = 128 * 1024;
+
+struct PageCache::Entry {
+    QImage image;
+    QVector<TextBox> text;
+    QVector<Link> links;
+    bool hasText = false;
+    bool hasLinks = false;
+
+    int cost() const
+    {
+        const qint64 bytes = image.sizeInBytes() + text.size() * sizeof(TextBox) + links.size() * sizeof(Link);
+        return qMax<qint64>(1, bytes / 1024);
+    }
+};
+
+PageCache::PageCache()
+    : m_entries(s_cacheCost), m_cancelled(false), m_verified(false)
+{
+}
+
+PageCache::~PageCache()
+{
+    stopCheck();
+    qDeleteAll(m_retained);
+}
+
+void PageCache::stopCheck()
+{
+    m_cancelled = true;
+
+    if (m_check.joinable()) {
+        m_check.join();
+    }
+
+    m_cancelled = false;
+    m_verified = false;
+    qDeleteAll(m_pending);
+    m_pending.clear();
+}
+
+PageCache::Entry *PageCache::take(int page)
+{
+    Entry *entry = m_entries.take(page);
+    return entry ? entry : new Entry;
+}
+
+void PageCache::insert(int page, Entry *entry)
+{
+    m_entries.insert(page, entry, entry->cost());
+}
+
+QImage PageCache::image(int page, const QSize &size) const
+{
+    const Entry *entry = m_entries.object(page);
+
+    if (!entry || entry->image.size() != size) {
+        return QImage();
+    }
+
+    return entry->image;
+}
+
+void PageCache::setImage(int page, const QImage &image)
+{
+    Entry *entry = take(page);
+    entry->image = image;
+    insert(page, entry);
+}
+
+bool PageCache::text(int page, QVector<TextBox> *boxes) const
+{
+    const Entry *entry = m_entries.object(page);
+
+    if (!entry || !entry->hasText) {
+        return false;
+    }
+
+    *boxes = entry->text;
+    return true;
+}
+
+void PageCache::setText(int page, const QVector<TextBox> &boxes)
+{
+    Entry *entry = take(page);
+    entry->text = boxes;
+    entry->hasText = true;
+    insert(page, entry);
+}
+
+bool PageCache::links(int page, QVector<Link> *links) const
+{
+    const Entry *entry = m_entries.object(page);
+
+    if (!entry || !entry->hasLinks) {
+        return false;
+    }
+
+    *links = entry->links;
+    return true;
+}
+
+void PageCache::setLinks(int page, const QVector<Link> &links)
+{
+    Entry *entry = take(page);
+    entry->links = links;
+    entry->hasLinks = true;
+    insert(page, entry);
+}
+
+void PageCache::clear()
+{
+    stopCheck();
+    m_entries.clear();
+    qDeleteAll(m_retained);
+    m_retained.clear();
+    m_revision = Document::Revision();
+}
+
+void PageCache::retain(const Document &doc)
+{
+    stopCheck();
+    qDeleteAll(m_retained);
+    m_retained.clear();
+    m_revision = doc.revision();
+
+    const QList<int> pages = m_entries.keys();
+
+    for (int page : pages) {
+        const int num = doc.pageObjectNumber(page);
+        Entry *entry = m_entries.take(page);
+
+        if (num > 0) {
+            m_retained.insert(num, entry);
+        } else {
+            delete entry;
+        }
+    }
+}
+
+int PageCache::restore(const Document &doc, const std::function<void()> &verified)
+{
+    stopCheck();
+    m_entries.clear();
+
+    const QSet<int> unchanged = m_retained.isEmpty() ? QSet<int>() : doc.unchangedPages(m_revision);
+
+    for (int page = 0; page < doc.pageCount() && !unchanged.isEmpty(); ++page) {
+        const int num = doc.pageObjectNumber(page);
+
+        if (unchanged.contains(num) && m_retained.contains(num)) {
+            m_pending.insert(page, m_retained.take(num));
+        }
+    }
+
+    qDeleteAll(m_retained);
+    m_retained.clear();
+
+    // Reading both files takes a while for large ones, pages rendered
+    // meanwhile are rendered anew
+    if (!m_pending.isEmpty()) {
+        m_check = std::thread([this, verified, old = m_revision, revision = doc.revision()] {
+            if (Document::isPrefix(old, revision, m_cancelled)) {
+                m_verified = true;
+                verified();
+            }
+        });
+    }
+
+    m_revision = Document::Revision();
+    return m_pending.size();
+}
+
+int PageCache::finishRestore()
+{
+    if (!m_verified) {
+        return 0;
+    }
+
+    if (m_check.joinable()) {
+        m_check.join();
+    }
+
+    int restored = 0;
+
+    for (auto it = m_pending.cbegin(); it != m_pending.cend(); ++it) {
+        if (m_entries.contains(it.key())) {
+            delete it.value();
+        } else {
+            insert(it.key(), it.value());
+            ++restored;
+        }
+    }
+
+    m_pending.clear();
+    m_verified = false;
+    return restored;
+}
+
+} // namespace QMuPDF
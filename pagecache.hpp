@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_PAGECACHE_HPP
+#define QMUPDF_PAGECACHE_HPP
+
+#include "document.hpp"
+#include "page.hpp"
+
+#include <QCache>
+#include <QHash>
+#include <QImage>
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace QMuPDF
+{
+
+// Keeps the last render, the text and the links of pages, so that they
+// survive reloading a file which only had incremental updates appended,
+// e.g. after another application added an annotation to one page.
+class PageCache
+{
+public:
+    PageCache();
+    ~PageCache();
+
+    QImage image(int page, const QSize &size) const;
+    void setImage(int page, const QImage &image);
+    bool text(int page, QVector<TextBox> *boxes) const;
+    void setText(int page, const QVector<TextBox> &boxes);
+    bool links(int page, QVector<Link> *links) const;
+    void setLinks(int page, const QVector<Link> &links);
+    void clear();
+
+    // Remembers the cached pages by their objects before doc is closed.
+    void retain(const Document &doc);
+    // Picks what was retained for the pages of the reloaded doc whose
+    // objects are unchanged and drops the rest. A thread then compares the
+    // old file with the new one and calls verified when they match, after
+    // which finishRestore() brings the pages back. Returns the number of
+    // pages picked.
+    int restore(const Document &doc, const std::function<void()> &verified);
+    // Returns the number of pages brought back, none if the comparison
+    // failed or is still running
+    int finishRestore();
+
+private:
+    Q_DISABLE_COPY(PageCache)
+    struct Entry;
+    Entry *take(int page);
+    void insert(int page, Entry *entry);
+    void stopCheck();
+
+    QCache<int, Entry> m_entries;
+    QHash<int, Entry *> m_retained;
+    Document::Revision m_revision;
+    // Picked by restore(), by page number
+    QHash<int, Entry *> m_pending;
+    std::thread m_check;
+    std::atomic<bool> m_cancelled;
+    std::atomic<bool> m_verified;
+};
+
+} // namespace QMuPDF
+
+#endif
@@ -0,0 +1,329 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "prefetcher.hpp"
+#include "document.hpp"
+#include "page.hpp"
+
+#include <QCache>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace QMuPDF
+{
+
+// Pages prefetched in reading direction, and against it
+static const int s_aheadCount = 2;
+static const int s_behindCount = 1;
+// Cache size in KiB
+static const int s_cacheCost = 64 * 1024;
+
+static quint64 cacheKey(int page, const QSize &size)
+{
+    return (quint64(page) << 40) | (quint64(size.width()) << 20) | quint64(size.height());
+}
+
+struct Job {
+    int page;
+    QSize size;
+    quint64 generation;
+};
+
+struct Worker {
+    std::thread thread;
+    fz_cookie cookie = { 0, 0, 0, 0, 0 };
+    Job job = { -1, QSize(), 0 };
+    bool busy = false;
+    // Whether the worker holds the document mutex
+    bool recording = false;
+};
+
+struct Prefetcher::Data {
+    Data(const Document &doc, QMutex *docMutex)
+        : doc(doc), docMutex(docMutex), cache(s_cacheCost) { }
+
+    const Document &doc;
+    QMutex *docMutex;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::deque<Job> queue;
+    QCache<quint64, QImage> cache;
+    QVector<QSizeF> pageSizes;
+    quint64 generation = 0;
+    int lastPage = -1;
+    bool suspended = false;
+    bool quit = false;
+
+    // Has to be called with mutex held
+    void abortRunning()
+    {
+        for (const auto &worker : workers) {
+            if (worker->busy) {
+                worker->cookie.abort = 1;
+            }
+        }
+    }
+
+    // Has to be called with mutex held, keeps a running job alive if it is
+    // still wanted after the viewport moved.
+    bool adoptRunning(int page, const QSize &size)
+    {
+        for (const auto &worker : workers) {
+            if (worker->busy && !worker->cookie.abort && worker->job.page == page && worker->job.size == size) {
+                worker->job.generation = generation;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool beginRecording(Worker *worker)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Let a visible request that is waiting for the document go first
+        if (suspended) {
+            worker->cookie.abort = 1;
+        }
+
+        worker->recording = worker->job.generation == generation && !worker->cookie.abort;
+        return worker->recording;
+    }
+
+    void endRecording(Worker *worker)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        worker->recording = false;
+    }
+
+    QImage render(fz_context *ctx, Worker *worker, const Job &job)
+    {
+        fz_display_list *list = nullptr;
+        {
+            QMutexLocker locker(docMutex);
+
+            // A visible request may have moved the viewport meanwhile
+            if (!beginRecording(worker)) {
+                return QImage();
+            }
+
+            if (doc.doc() && job.page < doc.pageCount()) {
+                // The render profile may have changed since the last job
+                doc.applyRenderOptions(ctx);
+                const Page page = doc.page(job.page);
+
+                // Left to the visible request, which simulates overprinting
+                if (!page.simulatesOverprint()) {
+                    list = page.displayList(&worker->cookie);
+                }
+            }
+
+            endRecording(worker);
+        }
+
+        if (!list) {
+            return QImage();
+        }
+
+        const QImage image = Page::render(ctx, list, job.size.width(), job.size.height(), &worker->cookie,
+                                          doc.imageCache(), doc.grayPages(), job.page);
+        fz_drop_display_list(ctx, list);
+        return image;
+    }
+
+    void run(Worker *worker, fz_context *ctx)
+    {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                worker->busy = false;
+                wakeup.wait(lock, [this] { return quit || (!suspended && !queue.empty()); });
+
+                if (quit) {
+                    break;
+                }
+
+                job = queue.front();
+                queue.pop_front();
+                worker->cookie = { 0, 0, 0, 0, 0 };
+                worker->job = job;
+                worker->busy = true;
+            }
+
+            const QImage image = render(ctx, worker, job);
+
+            if (!image.isNull()) {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (worker->job.generation == generation) {
+                    cache.insert(cacheKey(job.page, job.size), new QImage(image),
+                                 qMax<qsizetype>(1, image.sizeInBytes() / 1024));
+                }
+            }
+        }
+
+        fz_drop_context(ctx);
+    }
+};
+
+Prefetcher::Prefetcher(const Document &doc, QMutex *docMutex)
+    : d(new Data(doc, docMutex))
+{
+    // Leave one core to the visible requests
+    const int count = qBound(1, QThread::idealThreadCount() - 1, 2);
+
+    for (int i = 0; i < count; ++i) {
+        fz_context *ctx = doc.cloneContext();
+
+        if (!ctx) {
+            break;
+        }
+
+        auto worker = std::make_unique<Worker>();
+        worker->thread = std::thread(&Data::run, d, worker.get(), ctx);
+        d->workers.push_back(std::move(worker));
+    }
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->quit = true;
+        d->queue.clear();
+        d->abortRunning();
+    }
+    d->wakeup.notify_all();
+
+    for (const auto &worker : d->workers) {
+        worker->thread.join();
+    }
+
+    delete d;
+}
+
+void Prefetcher::setPageSizes(const QVector<QSizeF> &sizes)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->pageSizes = sizes;
+}
+
+QImage Prefetcher::take(int page, const QSize &size)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    QImage *image = d->cache.take(cacheKey(page, size));
+
+    if (!image) {
+        return QImage();
+    }
+
+    const QImage ret = *image;
+    delete image;
+    return ret;
+}
+
+void Prefetcher::preempt()
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->suspended = true;
+
+    // Rasterizing doesn't compete for the document, so only abort the
+    // workers that are still recording. schedule() decides on the rest.
+    for (const auto &worker : d->workers) {
+        if (worker->recording) {
+            worker->cookie.abort = 1;
+        }
+    }
+}
+
+void Prefetcher::schedule(int page, const QSize &size)
+{
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        const int pageCount = d->pageSizes.size();
+
+        if (page < 0 || page >= pageCount || size.isEmpty()) {
+            d->suspended = false;
+            return;
+        }
+
+        const bool backwards = page < d->lastPage;
+        const int step = backwards ? -1 : 1;
+        d->lastPage = page;
+        ++d->generation;
+        d->queue.clear();
+
+        const QSizeF current = d->pageSizes.at(page);
+        auto enqueue = [&](int n) {
+            if (n < 0 || n >= pageCount) {
+                return;
+            }
+
+            // Keep the zoom level of the visible page
+            const QSizeF s = d->pageSizes.at(n);
+            const QSize target(qRound(size.width() * s.width() / current.width()),
+                               qRound(size.height() * s.height() / current.height()));
+
+            if (!d->cache.contains(cacheKey(n, target)) && !d->adoptRunning(n, target)) {
+                d->queue.push_back({n, target, d->generation});
+            }
+        };
+
+        for (int i = 1; i <= s_aheadCount; ++i) {
+            enqueue(page + i * step);
+        }
+
+        for (int i = 1; i <= s_behindCount; ++i) {
+            enqueue(page - i * step);
+        }
+
+        // Whatever was not adopted above is out of the window now
+        for (const auto &worker : d->workers) {
+            if (worker->busy && worker->job.generation != d->generation) {
+                worker->cookie.abort = 1;
+            }
+        }
+
+        d->suspended = false;
+    }
+    d->wakeup.notify_all();
+}
+
+void Prefetcher::resume()
+{
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->suspended = false;
+    }
+    d->wakeup.notify_all();
+}
+
+void Prefetcher::clear()
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    ++d->generation;
+    d->queue.clear();
+    d->abortRunning();
+    d->cache.clear();
+    d->pageSizes.clear();
+    d->lastPage = -1;
+}
+
+} // namespace QMuPDF
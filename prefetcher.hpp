@@ -0,0 +1,58 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_PREFETCHER_HPP
+#define QMUPDF_PREFETCHER_HPP
+
+#include <QImage>
+#include <QSize>
+#include <QVector>
+
+class QMutex;
+
+namespace QMuPDF
+{
+
+class Document;
+
+// Speculatively renders the pages following the last visible request in
+// worker threads, so that paging forward can be served from a cache.
+// Pages are recorded into display lists while holding docMutex and
+// rasterized on cloned contexts without it.
+class Prefetcher
+{
+public:
+    Prefetcher(const Document &doc, QMutex *docMutex);
+    ~Prefetcher();
+
+    // Page sizes at any resolution, used to derive the size of neighbouring
+    // pages from the size of the visible one.
+    void setPageSizes(const QVector<QSizeF> &sizes);
+    // Returns and removes a prefetched image, or a null image on a miss.
+    QImage take(int page, const QSize &size);
+    // Aborts speculative work holding the document and holds off new work
+    // until schedule() or resume() is called. Has to be called before
+    // locking docMutex so a worker holding it can be made to let go.
+    void preempt();
+    // Replaces the pending speculative work by the neighbours of page in
+    // reading direction and resumes the workers.
+    void schedule(int page, const QSize &size);
+    void resume();
+    // Drops pending work and cached images, e.g. when closing the document.
+    void clear();
+
+private:
+    Q_DISABLE_COPY(Prefetcher)
+    struct Data;
+    Data *d;
+};
+
+} // namespace QMuPDF
+
+#endif
@@ -0,0 +1,266 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "progressivestream.hpp"
+
+#include <QDebug>
+#include <QFile>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace QMuPDF
+{
+
+static const qint64 s_blockSize = 64 * 1024;
+// Report progress at least every this many blocks
+static const int s_progressBlocks = 16;
+
+struct ProgressiveState {
+    ProgressiveState(const QString &fileName, qint64 length, qint64 bytesPerSecond,
+                     const std::function<void()> &progress)
+        : fileName(fileName), file(fileName), length(length), bytesPerSecond(bytesPerSecond)
+        , progress(progress), available((length + s_blockSize - 1) / s_blockSize, false)
+        , buffer(s_blockSize, Qt::Uninitialized) { }
+    ~ProgressiveState()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeup.notify_all();
+
+        if (fetcher.joinable()) {
+            fetcher.join();
+        }
+    }
+
+    const QString fileName;
+    // Read by MuPDF, fetching uses a file of its own
+    QFile file;
+    const qint64 length;
+    const qint64 bytesPerSecond;
+    const std::function<void()> progress;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<bool> available;
+    qint64 availableCount = 0;
+    qint64 requested = -1;
+    qint64 cursor = 0;
+    bool failed = false;
+    bool quit = false;
+    std::thread fetcher;
+
+    QByteArray buffer;
+
+    bool isComplete() const
+    {
+        return availableCount == qint64(available.size());
+    }
+
+    // Has to be called with mutex held, returns -1 once everything arrived
+    qint64 nextBlock()
+    {
+        if (requested >= 0 && !available[requested]) {
+            cursor = requested;
+        }
+
+        requested = -1;
+
+        for (qint64 i = 0; i < qint64(available.size()); ++i) {
+            const qint64 block = (cursor + i) % available.size();
+
+            if (!available[block]) {
+                return block;
+            }
+        }
+
+        return -1;
+    }
+
+    void fetch()
+    {
+        QFile source(fileName);
+        QByteArray data(s_blockSize, Qt::Uninitialized);
+        const auto start = std::chrono::steady_clock::now();
+        qint64 fetched = 0;
+        bool ok = source.open(QIODevice::ReadOnly);
+
+        for (int count = 1; ok; ++count) {
+            qint64 block;
+            bool wasRequested;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                wasRequested = requested >= 0;
+                block = nextBlock();
+
+                if (quit || block < 0) {
+                    break;
+                }
+            }
+
+            ok = source.seek(block * s_blockSize);
+            const qint64 read = ok ? source.read(data.data(), s_blockSize) : -1;
+            ok = read == qMin(s_blockSize, length - block * s_blockSize);
+
+            if (ok && bytesPerSecond > 0) {
+                fetched += read;
+                const auto due = start + std::chrono::milliseconds(fetched * 1000 / bytesPerSecond);
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait_until(lock, due, [this] { return quit; });
+            }
+
+            bool complete = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                if (ok) {
+                    available[block] = true;
+                    ++availableCount;
+                    cursor = block + 1;
+                    complete = isComplete();
+                }
+            }
+            wakeup.notify_all();
+
+            if (ok && progress && (wasRequested || complete || count % s_progressBlocks == 0)) {
+                progress();
+            }
+        }
+
+        if (!ok) {
+            qWarning() << "Error when fetching" << fileName;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+            }
+            wakeup.notify_all();
+
+            if (progress) {
+                progress();
+            }
+        }
+    }
+};
+
+static int nextProgressive(fz_context *ctx, fz_stream *stm, size_t max)
+{
+    auto *state = static_cast<ProgressiveState *>(stm->state);
+
+    if (stm->pos >= state->length) {
+        return EOF;
+    }
+
+    const qint64 block = stm->pos / s_blockSize;
+    bool available;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        available = state->available[block];
+
+        if (!available) {
+            state->requested = block;
+        }
+    }
+
+    // Don't throw out of the scope above, that would skip unlocking
+    if (!available) {
+        fz_throw(ctx, FZ_ERROR_TRYLATER, "waiting for offset %lld", (long long)stm->pos);
+    }
+
+    const qint64 len = qMin<qint64>(qMin<qint64>(max, s_blockSize), (block + 1) * s_blockSize - stm->pos);
+    unsigned char *data = reinterpret_cast<unsigned char *>(state->buffer.data());
+    const qint64 read = state->file.seek(stm->pos) ? state->file.read(state->buffer.data(), len) : -1;
+
+    if (read <= 0) {
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot read from file");
+    }
+
+    stm->rp = data;
+    stm->wp = data + read;
+    stm->pos += read;
+    return *stm->rp++;
+}
+
+static void seekProgressive(fz_context *, fz_stream *stm, int64_t offset, int whence)
+{
+    auto *state = static_cast<ProgressiveState *>(stm->state);
+
+    if (whence == SEEK_END) {
+        offset += state->length;
+    } else if (whence == SEEK_CUR) {
+        offset += stm->pos;
+    }
+
+    unsigned char *data = reinterpret_cast<unsigned char *>(state->buffer.data());
+    stm->rp = stm->wp = data;
+    stm->pos = qBound<int64_t>(0, offset, state->length);
+}
+
+static void dropProgressive(fz_context *, void *state)
+{
+    delete static_cast<ProgressiveState *>(state);
+}
+
+fz_stream *openProgressiveStream(fz_context *ctx, const QString &fileName, qint64 bytesPerSecond,
+                                 const std::function<void()> &progress)
+{
+    auto *state = new ProgressiveState(fileName, QFile(fileName).size(), bytesPerSecond, progress);
+
+    if (!state->file.open(QIODevice::ReadOnly)) {
+        delete state;
+        return nullptr;
+    }
+
+    fz_stream *stream = nullptr;
+    fz_var(stream);
+
+    fz_try(ctx) {
+        stream = fz_new_stream(ctx, state, nextProgressive, dropProgressive);
+    }
+    fz_catch(ctx) {
+        // fz_new_stream() already dropped the state
+        return nullptr;
+    }
+
+    stream->seek = seekProgressive;
+    stream->progressive = 1;
+    state->fetcher = std::thread(&ProgressiveState::fetch, state);
+    return stream;
+}
+
+bool waitForProgressiveStream(fz_stream *stream)
+{
+    auto *state = static_cast<ProgressiveState *>(stream->state);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    const qint64 count = state->availableCount;
+    state->wakeup.wait(lock, [state, count] {
+        return state->availableCount != count || state->isComplete() || state->failed || state->quit;
+    });
+    return state->availableCount != count;
+}
+
+bool isProgressiveStreamComplete(fz_stream *stream)
+{
+    auto *state = static_cast<ProgressiveState *>(stream->state);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->isComplete();
+}
+
+bool isProgressiveStreamFailed(fz_stream *stream)
+{
+    auto *state = static_cast<ProgressiveState *>(stream->state);
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->failed;
+}
+
+} // namespace QMuPDF
@@ -0,0 +1,42 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_PROGRESSIVESTREAM_HPP
+#define QMUPDF_PROGRESSIVESTREAM_HPP
+
+extern "C" {
+#include <mupdf/fitz.h>
+}
+
+#include <QString>
+
+#include <functional>
+
+namespace QMuPDF
+{
+
+// Opens fileName as a progressive stream: a background thread fetches the
+// file block by block, and reading a block that hasn't arrived yet throws
+// FZ_ERROR_TRYLATER and makes it the next one to fetch. This lets MuPDF
+// open (linearized) documents before they have been read completely.
+// progress is called from the fetching thread when data arrived. A positive
+// bytesPerSecond throttles fetching, to try slow mounts locally.
+fz_stream *openProgressiveStream(fz_context *ctx, const QString &fileName, qint64 bytesPerSecond,
+                                 const std::function<void()> &progress);
+// Blocks until more of the file arrived, returns false if nothing more
+// will arrive because the file is complete or can't be read.
+bool waitForProgressiveStream(fz_stream *stream);
+bool isProgressiveStreamComplete(fz_stream *stream);
+// Whether fetching stopped because the file couldn't be read, in which
+// case progress was called a last time
+bool isProgressiveStreamFailed(fz_stream *stream);
+
+} // namespace QMuPDF
+
+#endif
@@ -0,0 +1,196 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+// okular-mupdf-renderer <socket fd>: renders pages and extracts text for
+// RenderProcesses, so that a document crashing or stalling MuPDF only
+// takes this process down.
+
+#include "document.hpp"
+#include "page.hpp"
+#include "renderprotocol.hpp"
+
+#include <QDataStream>
+#include <QImage>
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace QMuPDF;
+
+// Address space the renderer may use
+static const rlim_t s_memoryLimit = rlim_t(4) * 1024 * 1024 * 1024;
+
+static void sandbox()
+{
+    // Don't outlive Okular, and gain no privileges through exec
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+
+    const rlimit memory = { s_memoryLimit, s_memoryLimit };
+    setrlimit(RLIMIT_AS, &memory);
+    const rlimit core = { 0, 0 };
+    setrlimit(RLIMIT_CORE, &core);
+}
+
+static bool openDocument(Document *doc, const QByteArray &data)
+{
+    const int separator = data.indexOf('\0');
+
+    if (separator < 0) {
+        return false;
+    }
+
+    doc->close();
+
+    if (!doc->load(QString::fromUtf8(data.left(separator)))) {
+        return false;
+    }
+
+    return !doc->isLocked() || doc->unlock(data.mid(separator + 1));
+}
+
+static bool renderPage(Document *doc, const RenderProtocol::Request &request, int memfd,
+                       RenderProtocol::Reply *reply)
+{
+    const qint64 size = qint64(request.tileWidth) * request.tileHeight * 4;
+    struct stat st;
+
+    if (memfd < 0 || request.page < 0 || request.page >= doc->pageCount() || fstat(memfd, &st) < 0
+        || st.st_size != size) {
+        return false;
+    }
+
+    // Mapped before rendering, so that the page is drawn straight into it.
+    // Only what is written takes memory, e.g. a quarter for gray pages.
+    void *pixels = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+    if (pixels == MAP_FAILED) {
+        return false;
+    }
+
+    const QRect tile(request.tileX, request.tileY, request.tileWidth, request.tileHeight);
+    const bool whole = tile == QRect(0, 0, request.width, request.height);
+    const Page::Allocator allocate = [&](const QSize &imageSize, QImage::Format format) {
+        // Rows aligned like QImage's own
+        const qsizetype bytesPerLine = (qsizetype(imageSize.width()) * (format == QImage::Format_Grayscale8 ? 1 : 3)
+                                        + 3) & ~qsizetype(3);
+
+        if (imageSize != tile.size() || bytesPerLine * imageSize.height() > size) {
+            return QImage();
+        }
+
+        return QImage(static_cast<uchar *>(pixels), imageSize.width(), imageSize.height(), bytesPerLine, format);
+    };
+    bool incomplete = false;
+    QImage img = doc->page(request.page).render(request.width, request.height, whole ? QRect() : tile,
+                                                &incomplete, allocate);
+    const bool ok = !img.isNull() && img.constBits() == pixels;
+
+    if (ok) {
+        reply->incomplete = incomplete;
+        reply->format = img.format();
+        reply->bytesPerLine = img.bytesPerLine();
+    }
+
+    img = QImage();
+    munmap(pixels, size);
+    return ok;
+}
+
+static QByteArray extractText(Document *doc, const RenderProtocol::Request &request)
+{
+    if (request.page < 0 || request.page >= doc->pageCount()) {
+        return QByteArray();
+    }
+
+    const QVector<TextBox *> boxes = doc->page(request.page).textBoxes(QSizeF(request.dpiX, request.dpiY));
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream << qint32(boxes.size());
+
+    for (const TextBox *box : boxes) {
+        stream << box->text() << box->rect() << box->isAtEndOfLine();
+    }
+
+    qDeleteAll(boxes);
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        return EXIT_FAILURE;
+    }
+
+    const int socket = atoi(argv[1]);
+    sandbox();
+    Document doc;
+
+    for (;;) {
+        RenderProtocol::Request request;
+        int memfd = -1;
+
+        // The other end is gone, Okular quit or restarts us
+        if (!RenderProtocol::receiveAll(socket, &request, sizeof(request), &memfd)) {
+            return EXIT_SUCCESS;
+        }
+
+        QByteArray data(qMax(0, request.dataSize), Qt::Uninitialized);
+
+        if (!data.isEmpty() && !RenderProtocol::receiveAll(socket, data.data(), data.size())) {
+            return EXIT_SUCCESS;
+        }
+
+        RenderOptions options;
+        options.icc = request.icc;
+        options.textAA = request.textAA;
+        options.graphicsAA = request.graphicsAA;
+        options.overprint = request.overprint;
+
+        if (!(options == doc.renderOptions())) {
+            doc.setRenderOptions(options);
+        }
+
+        RenderProtocol::Reply reply = { 0, 0, 0, 0, 0 };
+        QByteArray out;
+
+        switch (request.kind) {
+        case RenderProtocol::Open:
+            reply.ok = openDocument(&doc, data);
+            break;
+        case RenderProtocol::Render:
+            doc.setLayerState(data);
+            reply.ok = renderPage(&doc, request, memfd, &reply);
+            break;
+        case RenderProtocol::Text:
+            doc.setLayerState(data);
+            out = extractText(&doc, request);
+            reply.ok = !out.isEmpty();
+            break;
+        }
+
+        if (memfd >= 0) {
+            close(memfd);
+        }
+
+        reply.dataSize = out.size();
+
+        if (!RenderProtocol::sendAll(socket, &reply, sizeof(reply))
+            || (!out.isEmpty() && !RenderProtocol::sendAll(socket, out.constData(), out.size()))) {
+            return EXIT_SUCCESS;
+        }
+    }
+}
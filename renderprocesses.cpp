@@ -0,0 +1,388 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "renderprocesses.hpp"
+#include "page.hpp"
+#include "renderprotocol.hpp"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QThread>
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace QMuPDF
+{
+
+// Where helpers find their end of the socket
+static const int s_socketFd = 3;
+// A helper not answering for this long, in milliseconds, is stalled. Large
+// renders get more time per megapixel, as rasterizing takes longer.
+static const int s_timeout = 30000;
+static const int s_timeoutPerMegapixel = 1000;
+// Replies carrying more data than this, in bytes, come from a broken
+// helper. Text boxes of even the densest pages take a few megabytes.
+static const qint32 s_maxReplySize = 64 * 1024 * 1024;
+
+struct Worker {
+    pid_t pid = -1;
+    int socket = -1;
+    // Of the document the helper has open, -1 for none
+    int generation = -1;
+    bool busy = false;
+};
+
+static bool spawn(Worker *worker)
+{
+    int sockets[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0) {
+        return false;
+    }
+
+    // dup2() only clears close-on-exec if it actually duplicates, so the
+    // end of the helper must not be at s_socketFd already
+    const int child = fcntl(sockets[1], F_DUPFD_CLOEXEC, s_socketFd + 1);
+    ::close(sockets[1]);
+
+    if (child < 0) {
+        ::close(sockets[0]);
+        return false;
+    }
+
+    QByteArray path(QMUPDF_RENDERER);
+    QByteArray fd = QByteArray::number(s_socketFd);
+    char *argv[] = { path.data(), fd.data(), nullptr };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, child, s_socketFd);
+    pid_t pid;
+    const int error = posix_spawn(&pid, path.constData(), &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(child);
+
+    if (error) {
+        qWarning() << "Cannot start" << path << strerror(error);
+        ::close(sockets[0]);
+        return false;
+    }
+
+    worker->pid = pid;
+    worker->socket = sockets[0];
+    worker->generation = -1;
+    return true;
+}
+
+static void forget(Worker *worker)
+{
+    ::close(worker->socket);
+    worker->pid = -1;
+    worker->socket = -1;
+    worker->generation = -1;
+}
+
+static void stop(Worker *worker)
+{
+    if (worker->pid < 0) {
+        return;
+    }
+
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, nullptr, 0);
+    forget(worker);
+}
+
+static int timeout(const RenderProtocol::Request &request)
+{
+    if (request.kind != RenderProtocol::Render) {
+        return s_timeout;
+    }
+
+    const qint64 pixels = qint64(request.tileWidth) * request.tileHeight;
+    return int(qMin<qint64>(INT_MAX, s_timeout + pixels * s_timeoutPerMegapixel / (1024 * 1024)));
+}
+
+// Sends request with data and waits for the reply, stopping the helper if
+// it crashed or stalled, to be started again on the next request
+static bool call(Worker *worker, RenderProtocol::Request request, const QByteArray &data, int memfd,
+                 RenderProtocol::Reply *reply, QByteArray *out)
+{
+    request.dataSize = data.size();
+    bool ok = RenderProtocol::sendAll(worker->socket, &request, sizeof(request), memfd)
+        && (data.isEmpty() || RenderProtocol::sendAll(worker->socket, data.constData(), data.size()))
+        && RenderProtocol::receiveAll(worker->socket, reply, sizeof(*reply), nullptr, timeout(request));
+
+    if (ok && (reply->dataSize < 0 || reply->dataSize > s_maxReplySize)) {
+        qWarning() << "okular-mupdf-renderer replied with" << reply->dataSize << "bytes";
+        ok = false;
+    } else if (ok && reply->dataSize > 0) {
+        out->resize(reply->dataSize);
+        ok = RenderProtocol::receiveAll(worker->socket, out->data(), out->size(), nullptr, s_timeout);
+    }
+
+    if (!ok) {
+        qWarning() << "okular-mupdf-renderer crashed or stalled on page" << request.page + 1;
+        stop(worker);
+    }
+
+    return ok;
+}
+
+static void setOptions(RenderProtocol::Request *request, const RenderOptions &options)
+{
+    request->icc = options.icc;
+    request->textAA = options.textAA;
+    request->graphicsAA = options.graphicsAA;
+    request->overprint = options.overprint;
+}
+
+struct Mapping {
+    void *data;
+    size_t size;
+};
+
+static void unmap(void *info)
+{
+    Mapping *mapping = static_cast<Mapping *>(info);
+    munmap(mapping->data, mapping->size);
+    delete mapping;
+}
+
+struct RenderProcesses::Data {
+    bool start(Worker *worker);
+    bool open(Worker *worker, const QByteArray &document, int generation, const RenderOptions &options);
+    bool run(RenderProtocol::Request request, int memfd, RenderProtocol::Reply *reply, QByteArray *out);
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::vector<Worker> workers;
+    // The file name, a null byte and the password
+    QByteArray document;
+    // Counts the documents opened, for helpers to open the current one
+    int generation = 0;
+    RenderOptions options;
+    QByteArray layers;
+    bool available = true;
+};
+
+bool RenderProcesses::Data::start(Worker *worker)
+{
+    // Gone while idle, e.g. killed for using too much memory
+    if (worker->pid >= 0 && waitpid(worker->pid, nullptr, WNOHANG) == worker->pid) {
+        forget(worker);
+    }
+
+    if (worker->pid >= 0 || spawn(worker)) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    available = false;
+    return false;
+}
+
+bool RenderProcesses::Data::open(Worker *worker, const QByteArray &document, int generation,
+                                 const RenderOptions &options)
+{
+    if (worker->generation == generation) {
+        return true;
+    }
+
+    RenderProtocol::Request request {};
+    request.kind = RenderProtocol::Open;
+    setOptions(&request, options);
+    RenderProtocol::Reply reply = { 0, 0, 0, 0, 0 };
+    QByteArray out;
+
+    if (!call(worker, request, document, -1, &reply, &out) || !reply.ok) {
+        return false;
+    }
+
+    worker->generation = generation;
+    return true;
+}
+
+bool RenderProcesses::Data::run(RenderProtocol::Request request, int memfd, RenderProtocol::Reply *reply,
+                                QByteArray *out)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    const auto isIdle = [](const Worker &worker) { return !worker.busy; };
+    idle.wait(lock, [&] { return std::any_of(workers.begin(), workers.end(), isIdle); });
+    Worker *worker = &*std::find_if(workers.begin(), workers.end(), isIdle);
+    worker->busy = true;
+    const QByteArray document = this->document;
+    const int generation = this->generation;
+    const RenderOptions options = this->options;
+    const QByteArray layers = this->layers;
+    lock.unlock();
+
+    setOptions(&request, options);
+    const bool ok = !document.isEmpty() && start(worker) && open(worker, document, generation, options)
+        && call(worker, request, layers, memfd, reply, out) && reply->ok;
+
+    lock.lock();
+    worker->busy = false;
+    idle.notify_one();
+    return ok;
+}
+
+RenderProcesses::RenderProcesses(int maxCount)
+    : d(new Data)
+{
+    // Helpers only start with their first request, so idle ones cost nothing
+    d->workers.resize(qBound(1, QThread::idealThreadCount(), maxCount));
+}
+
+RenderProcesses::~RenderProcesses()
+{
+    for (Worker &worker : d->workers) {
+        stop(&worker);
+    }
+
+    delete d;
+}
+
+bool RenderProcesses::isAvailable() const
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    return d->available;
+}
+
+void RenderProcesses::open(const QString &fileName, const QByteArray &password)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->document = fileName.toUtf8() + '\0' + password;
+    d->layers.clear();
+    ++d->generation;
+}
+
+void RenderProcesses::close()
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->document.clear();
+    d->layers.clear();
+    ++d->generation;
+}
+
+void RenderProcesses::setRenderOptions(const RenderOptions &options)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->options = options;
+}
+
+void RenderProcesses::setLayerState(const QByteArray &state)
+{
+    std::lock_guard<std::mutex> lock(d->mutex);
+    d->layers = state;
+}
+
+QImage RenderProcesses::render(int page, const QSize &size, const QRect &tile, bool *incomplete)
+{
+    const QRect area = tile.isNull() ? QRect(QPoint(0, 0), size) : tile;
+
+    if (area.isEmpty()) {
+        return QImage();
+    }
+
+    const size_t bytes = size_t(area.width()) * area.height() * 4;
+    const int memfd = memfd_create("okular-mupdf-pixmap", MFD_CLOEXEC);
+
+    if (memfd < 0) {
+        return QImage();
+    }
+
+    RenderProtocol::Request request {};
+    request.kind = RenderProtocol::Render;
+    request.page = page;
+    request.width = size.width();
+    request.height = size.height();
+    request.tileX = area.x();
+    request.tileY = area.y();
+    request.tileWidth = area.width();
+    request.tileHeight = area.height();
+    RenderProtocol::Reply reply = { 0, 0, 0, 0, 0 };
+    QByteArray out;
+    void *pixels = MAP_FAILED;
+
+    // The helper renders the image straight into the memfd, which the
+    // returned image maps instead of reading the pixels from the socket.
+    // Gray and RGB images are smaller than the memfd, whose pages only take
+    // memory once written.
+    if (ftruncate(memfd, bytes) == 0 && d->run(request, memfd, &reply, &out)
+        && (reply.format == QImage::Format_Grayscale8 || reply.format == QImage::Format_RGB888)
+        && reply.bytesPerLine >= area.width() * (reply.format == QImage::Format_Grayscale8 ? 1 : 3)
+        && size_t(reply.bytesPerLine) * area.height() <= bytes) {
+        pixels = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+
+    ::close(memfd);
+
+    if (pixels == MAP_FAILED) {
+        return QImage();
+    }
+
+    if (incomplete) {
+        *incomplete = reply.incomplete;
+    }
+
+    return QImage(static_cast<uchar *>(pixels), area.width(), area.height(), reply.bytesPerLine,
+                  QImage::Format(reply.format), unmap, new Mapping { pixels, bytes });
+}
+
+bool RenderProcesses::textBoxes(int page, const QSizeF &dpi, QVector<TextBox> *boxes)
+{
+    RenderProtocol::Request request {};
+    request.kind = RenderProtocol::Text;
+    request.page = page;
+    request.dpiX = dpi.width();
+    request.dpiY = dpi.height();
+    RenderProtocol::Reply reply = { 0, 0, 0, 0, 0 };
+    QByteArray out;
+
+    if (!d->run(request, -1, &reply, &out)) {
+        return false;
+    }
+
+    QDataStream stream(out);
+    qint32 count = 0;
+    stream >> count;
+
+    for (qint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+        QChar c;
+        QRectF rect;
+        bool end;
+        stream >> c >> rect >> end;
+        TextBox box(c, rect);
+
+        if (end) {
+            box.markAtEndOfLine();
+        }
+
+        boxes->append(box);
+    }
+
+    return stream.status() == QDataStream::Ok;
+}
+
+} // namespace QMuPDF
@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_RENDERPROCESSES_HPP
+#define QMUPDF_RENDERPROCESSES_HPP
+
+#include "document.hpp"
+
+#include <QImage>
+
+namespace QMuPDF
+{
+
+class TextBox;
+
+// Renders pages and extracts text in okular-mupdf-renderer helper
+// processes, which open the document on their own. A helper that crashes
+// or stalls is killed and started again with the next request, which only
+// fails the request it was working on. Helpers render the pixels into shared
+// memory, which the returned images are backed by, so they don't go
+// through the socket.
+//
+// All methods can be called from any thread, a request waits for an idle
+// helper.
+class RenderProcesses
+{
+public:
+    // Runs a helper per core, but no more than maxCount
+    explicit RenderProcesses(int maxCount);
+    ~RenderProcesses();
+
+    // False once a helper couldn't be started
+    bool isAvailable() const;
+    // Has the helpers open fileName, when they next get a request
+    void open(const QString &fileName, const QByteArray &password);
+    void close();
+    void setRenderOptions(const RenderOptions &options);
+    // Shows the layers given by Document::layerState()
+    void setLayerState(const QByteArray &state);
+
+    // Like Page::render(), returns a null image if the helper failed
+    QImage render(int page, const QSize &size, const QRect &tile = QRect(), bool *incomplete = nullptr);
+    // Like Page::textBoxes()
+    bool textBoxes(int page, const QSizeF &dpi, QVector<TextBox> *boxes);
+
+private:
+    Q_DISABLE_COPY(RenderProcesses)
+    struct Data;
+    Data *d;
+};
+
+} // namespace QMuPDF
+
+#endif
@@ -0,0 +1,136 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "renderprotocol.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace QMuPDF
+{
+
+namespace RenderProtocol
+{
+
+bool sendAll(int socket, const void *data, size_t size, int passFd)
+{
+    const char *p = static_cast<const char *>(data);
+
+    while (size > 0) {
+        iovec iov = { const_cast<char *>(p), size };
+        union {
+            cmsghdr align;
+            char buffer[CMSG_SPACE(sizeof(int))];
+        } control;
+        msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        // The descriptor goes along with the first byte
+        if (passFd >= 0) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = sizeof(control.buffer);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+        }
+
+        const ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent <= 0) {
+            return false;
+        }
+
+        passFd = -1;
+        p += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+bool receiveAll(int socket, void *data, size_t size, int *passedFd, int timeout)
+{
+    char *p = static_cast<char *>(data);
+
+    if (passedFd) {
+        *passedFd = -1;
+    }
+
+    while (size > 0) {
+        if (timeout >= 0) {
+            pollfd pfd = { socket, POLLIN, 0 };
+            int ready;
+
+            do {
+                ready = poll(&pfd, 1, timeout);
+            } while (ready < 0 && errno == EINTR);
+
+            if (ready <= 0) {
+                return false;
+            }
+        }
+
+        iovec iov = { p, size };
+        union {
+            cmsghdr align;
+            char buffer[CMSG_SPACE(sizeof(int))];
+        } control;
+        msghdr msg {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        const ssize_t received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (received <= 0) {
+            return false;
+        }
+
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+            if (passedFd && *passedFd < 0) {
+                *passedFd = fd;
+            } else {
+                close(fd);
+            }
+        }
+
+        p += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+} // namespace RenderProtocol
+
+} // namespace QMuPDF
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_RENDERPROTOCOL_HPP
+#define QMUPDF_RENDERPROTOCOL_HPP
+
+#include <QtGlobal>
+
+#include <cstddef>
+
+namespace QMuPDF
+{
+
+// What RenderProcesses and okular-mupdf-renderer exchange over a Unix
+// socket. Both are built from the same tree, so structs go as they are.
+namespace RenderProtocol
+{
+
+enum Kind : qint32 {
+    // Followed by the file name, a null byte and the password
+    Open,
+    // Comes with a memfd of tileWidth * tileHeight * 4 bytes, enough for
+    // any format Page::render() returns, which the renderer fills with the
+    // image. Followed by the layers to show, see Document::layerState(), as
+    // is Text.
+    Render,
+    // Answered by the text boxes, see RenderProcesses::textBoxes()
+    Text
+};
+
+struct Request {
+    qint32 kind;
+    qint32 page;
+    qint32 width;
+    qint32 height;
+    qint32 tileX;
+    qint32 tileY;
+    qint32 tileWidth;
+    qint32 tileHeight;
+    double dpiX;
+    double dpiY;
+    qint32 icc;
+    qint32 textAA;
+    qint32 graphicsAA;
+    qint32 overprint;
+    qint32 dataSize;
+};
+
+struct Reply {
+    qint32 ok;
+    qint32 incomplete;
+    // QImage::Format and line length of a rendered image
+    qint32 format;
+    qint32 bytesPerLine;
+    qint32 dataSize;
+};
+
+// Sends all of data, along with passFd if it isn't -1
+bool sendAll(int socket, const void *data, size_t size, int passFd = -1);
+// Receives exactly size bytes, and a file descriptor passed along if
+// passedFd is given, which is set to -1 if there was none. Fails if
+// nothing arrives for timeout milliseconds, unless it is -1.
+bool receiveAll(int socket, void *data, size_t size, int *passedFd = nullptr, int timeout = -1);
+
+} // namespace RenderProtocol
+
+} // namespace QMuPDF
+
+#endif
@@ -0,0 +1,179 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+// Replays a trace recorded with QMUPDF_TRACE against QMuPDF::Document,
+// with the requests of each lane on a thread of its own and serialized by
+// one mutex like the generator does, to profile a session
+// deterministically. Requests are made with the render profile and layers
+// they were recorded with.
+
+#include "document.hpp"
+#include "page.hpp"
+#include "trace.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QMap>
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using namespace QMuPDF;
+
+static qint64 replay(Document &doc, QMutex *docMutex, const TraceEntry &entry)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QMutexLocker locker(docMutex);
+
+    // As the request was made with
+    if (!(doc.renderOptions() == entry.options)) {
+        doc.setRenderOptions(entry.options);
+    }
+
+    if (doc.layerState() != entry.layers) {
+        doc.setLayerState(entry.layers);
+    }
+
+    const Page page = doc.page(entry.page);
+
+    if (entry.kind == TraceEntry::Text) {
+        qDeleteAll(page.textBoxes(entry.dpi));
+    } else {
+        (void)page.render(entry.size.width(), entry.size.height(), entry.tile);
+    }
+
+    return timer.nsecsElapsed() / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Replays requests recorded with QMUPDF_TRACE"));
+    parser.addHelpOption();
+    parser.addOption({QStringLiteral("session"), QStringLiteral("Replay the n-th document of the trace."),
+                      QStringLiteral("n"), QStringLiteral("1")});
+    parser.addOption({QStringLiteral("password"), QStringLiteral("Password of the document."),
+                      QStringLiteral("password")});
+    parser.addOption({QStringLiteral("no-wait"),
+                      QStringLiteral("Start each request as soon as the previous one of its lane finished.")});
+    parser.addPositionalArgument(QStringLiteral("trace"), QStringLiteral("The recorded trace."));
+    parser.addPositionalArgument(QStringLiteral("document"),
+                                 QStringLiteral("The document, if not where it was recorded."), QStringLiteral("[document]"));
+    parser.process(app);
+
+    const QStringList args = parser.positionalArguments();
+
+    if (args.isEmpty() || args.size() > 2) {
+        parser.showHelp(1);
+    }
+
+    QVector<TraceSession> sessions;
+
+    if (!Trace::read(args.at(0), &sessions)) {
+        fprintf(stderr, "Cannot read the trace %s\n", qPrintable(args.at(0)));
+        return 1;
+    }
+
+    const int index = parser.value(QStringLiteral("session")).toInt() - 1;
+
+    if (index < 0 || index >= sessions.size()) {
+        fprintf(stderr, "The trace has %d sessions\n", int(sessions.size()));
+        return 1;
+    }
+
+    const TraceSession &session = sessions.at(index);
+    const QString fileName = args.size() > 1 ? args.at(1) : session.document;
+    Document doc;
+
+    if (!doc.load(fileName)
+        || (doc.isLocked() && !doc.unlock(parser.value(QStringLiteral("password")).toLocal8Bit()))) {
+        fprintf(stderr, "Cannot open %s\n", qPrintable(fileName));
+        return 1;
+    }
+
+    if (doc.pageCount() != session.pageCount) {
+        fprintf(stderr, "Warning: %s has %d pages, the recorded one had %d\n", qPrintable(fileName),
+                doc.pageCount(), session.pageCount);
+    }
+
+    QMap<int, QVector<int>> lanes;
+
+    for (int i = 0; i < session.entries.size(); ++i) {
+        lanes[session.entries.at(i).lane].append(i);
+    }
+
+    const bool wait = !parser.isSet(QStringLiteral("no-wait"));
+    std::vector<qint64> durations(session.entries.size(), -1);
+    QMutex docMutex;
+    QElapsedTimer clock;
+    std::vector<std::thread> threads;
+    clock.start();
+
+    for (const QVector<int> &lane : qAsConst(lanes)) {
+        threads.emplace_back([&, lane] {
+            for (int i : lane) {
+                const TraceEntry &entry = session.entries.at(i);
+
+                if (entry.page < 0 || entry.page >= doc.pageCount()) {
+                    continue;
+                }
+
+                const qint64 due = entry.start - clock.nsecsElapsed() / 1000;
+
+                if (wait && due > 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(due));
+                }
+
+                durations[i] = replay(doc, &docMutex, entry);
+            }
+        });
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    const qint64 total = clock.nsecsElapsed() / 1000;
+    qint64 recordedSum = 0;
+    qint64 replayedSum = 0;
+
+    printf("lane kind page size tile recorded_us replayed_us\n");
+
+    for (int i = 0; i < session.entries.size(); ++i) {
+        const TraceEntry &entry = session.entries.at(i);
+
+        if (durations.at(i) < 0) {
+            continue;
+        }
+
+        const QString size = entry.kind == TraceEntry::Text
+            ? QStringLiteral("-")
+            : QStringLiteral("%1x%2").arg(entry.size.width()).arg(entry.size.height());
+        const QString tile = entry.tile.isNull()
+            ? QStringLiteral("-")
+            : QStringLiteral("%1,%2+%3x%4").arg(entry.tile.x()).arg(entry.tile.y())
+                  .arg(entry.tile.width()).arg(entry.tile.height());
+        printf("%d %c %d %s %s %lld %lld\n", entry.lane, entry.kind == TraceEntry::Text ? 'T' : 'P', entry.page,
+               qPrintable(size), qPrintable(tile), entry.duration, durations.at(i));
+        recordedSum += entry.duration;
+        replayedSum += durations.at(i);
+    }
+
+    printf("# %d requests, recorded %lld us, replayed %lld us, wall clock %lld us\n",
+           int(session.entries.size()), recordedSum, replayedSum, total);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#include "trace.hpp"
+
+#include <QDebug>
+#include <QThread>
+
+namespace QMuPDF
+{
+
+// Lines are
+//   D <page count> <document>
+//   P <lane> <start> <duration> <page> <width> <height> <tile x> <tile y> <tile width> <tile height> <priority> <preload> <settings>
+//   T <lane> <start> <duration> <page> <settings>
+// where the D line starts the session its requests belong to, and settings
+// are
+//   <icc> <text AA> <graphics AA> <overprint> <layer state, - for none> <dpi x> <dpi y>
+// which version 1 traces don't have, and version 2 traces lack the dpi of.
+static const char s_header[] = "# qmupdf-trace 3\n";
+static const int s_settingsFields = 7;
+static const int s_dpiFields = 2;
+
+static QByteArray settings(const TraceEntry &entry)
+{
+    return QString::asprintf(" %d %d %d %d ", entry.options.icc ? 1 : 0, entry.options.textAA,
+                             entry.options.graphicsAA, entry.options.overprint ? 1 : 0).toLatin1()
+        + (entry.layers.isEmpty() ? QByteArray("-") : entry.layers) + ' ' + QByteArray::number(entry.dpi.width())
+        + ' ' + QByteArray::number(entry.dpi.height());
+}
+
+// Reads the settings following the first count fields, if there are any
+static void readSettings(const QList<QByteArray> &fields, int count, TraceEntry *entry)
+{
+    if (fields.size() != count + s_settingsFields && fields.size() != count + s_settingsFields - s_dpiFields) {
+        return;
+    }
+
+    entry->options.icc = fields.at(count).toInt();
+    entry->options.textAA = fields.at(count + 1).toInt();
+    entry->options.graphicsAA = fields.at(count + 2).toInt();
+    entry->options.overprint = fields.at(count + 3).toInt();
+    entry->layers = fields.at(count + 4) == "-" ? QByteArray() : fields.at(count + 4);
+
+    if (fields.size() == count + s_settingsFields) {
+        entry->dpi = QSizeF(fields.at(count + 5).toDouble(), fields.at(count + 6).toDouble());
+    }
+}
+
+Trace::Trace(const QString &fileName)
+    : m_file(fileName)
+{
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Cannot record the trace to" << fileName;
+        return;
+    }
+
+    if (m_file.size() == 0) {
+        m_file.write(s_header);
+    }
+
+    m_timer.start();
+}
+
+bool Trace::isEnabled() const
+{
+    return m_file.isOpen();
+}
+
+void Trace::begin(const QString &document, int pageCount)
+{
+    if (!isEnabled()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_timer.restart();
+    m_lanes.clear();
+    write("D " + QByteArray::number(pageCount) + ' ' + document.toUtf8());
+}
+
+qint64 Trace::now() const
+{
+    if (!isEnabled()) {
+        return 0;
+    }
+
+    // begin() restarts the timer from another thread
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_timer.nsecsElapsed() / 1000;
+}
+
+void Trace::record(TraceEntry entry)
+{
+    if (!isEnabled()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const Qt::HANDLE thread = QThread::currentThreadId();
+
+    if (!m_lanes.contains(thread)) {
+        m_lanes.insert(thread, m_lanes.size());
+    }
+
+    entry.lane = m_lanes.value(thread);
+
+    if (entry.kind == TraceEntry::Text) {
+        write(QByteArray("T ") + QByteArray::number(entry.lane) + ' ' + QByteArray::number(entry.start) + ' '
+              + QByteArray::number(entry.duration) + ' ' + QByteArray::number(entry.page) + settings(entry));
+        return;
+    }
+
+    write(QString::asprintf("P %d %lld %lld %d %d %d %d %d %d %d %d %d", entry.lane, entry.start, entry.duration,
+                            entry.page, entry.size.width(), entry.size.height(), entry.tile.x(), entry.tile.y(),
+                            entry.tile.width(), entry.tile.height(), entry.priority, entry.preload ? 1 : 0)
+              .toLatin1() + settings(entry));
+}
+
+void Trace::write(const QByteArray &line)
+{
+    m_file.write(line + '\n');
+    // What was recorded up to a crash or a stall is the interesting part
+    m_file.flush();
+}
+
+bool Trace::read(const QString &fileName, QVector<TraceSession> *sessions)
+{
+    QFile file(fileName);
+
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    while (!file.atEnd()) {
+        const QByteArray line = file.readLine().trimmed();
+
+        if (line.isEmpty() || line.startsWith('#')) {
+            continue;
+        }
+
+        if (line.startsWith("D ")) {
+            const int space = line.indexOf(' ', 2);
+
+            if (space < 0) {
+                return false;
+            }
+
+            TraceSession session;
+            session.pageCount = line.mid(2, space - 2).toInt();
+            session.document = QString::fromUtf8(line.mid(space + 1));
+            sessions->append(session);
+            continue;
+        }
+
+        const QList<QByteArray> fields = line.split(' ');
+        TraceEntry entry;
+
+        if (sessions->isEmpty() || fields.size() < 5) {
+            return false;
+        }
+
+        entry.lane = fields.at(1).toInt();
+        entry.start = fields.at(2).toLongLong();
+        entry.duration = fields.at(3).toLongLong();
+        entry.page = fields.at(4).toInt();
+
+        if (fields.at(0) == "T") {
+            entry.kind = TraceEntry::Text;
+            readSettings(fields, 5, &entry);
+        } else if (fields.at(0) == "P" && fields.size() >= 13) {
+            entry.kind = TraceEntry::Pixmap;
+            entry.size = QSize(fields.at(5).toInt(), fields.at(6).toInt());
+            entry.tile = QRect(fields.at(7).toInt(), fields.at(8).toInt(), fields.at(9).toInt(), fields.at(10).toInt());
+            entry.priority = fields.at(11).toInt();
+            entry.preload = fields.at(12).toInt();
+            readSettings(fields, 13, &entry);
+        } else {
+            return false;
+        }
+
+        sessions->last().entries.append(entry);
+    }
+
+    return true;
+}
+
+} // namespace QMuPDF
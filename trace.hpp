@@ -0,0 +1,91 @@
+/***************************************************************************
+ *   Copyright (C) 2026 by the okular-backend-mupdf contributors           *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ ***************************************************************************/
+
+#ifndef QMUPDF_TRACE_HPP
+#define QMUPDF_TRACE_HPP
+
+#include "document.hpp"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QRect>
+#include <QSizeF>
+#include <QString>
+#include <QVector>
+
+#include <mutex>
+
+namespace QMuPDF
+{
+
+// A request Okular made, times are in microseconds since the document was
+// loaded
+struct TraceEntry {
+    enum Kind {
+        Pixmap,
+        Text
+    };
+    Kind kind = Pixmap;
+    // Thread the request came from, numbered in order of appearance
+    int lane = 0;
+    qint64 start = 0;
+    qint64 duration = 0;
+    int page = 0;
+    // Pixmap requests only, tile is null for whole pages
+    QSize size;
+    QRect tile;
+    int priority = 0;
+    bool preload = false;
+    // What the document was rendered with, see Document::layerState()
+    RenderOptions options;
+    QByteArray layers;
+    // Of the generator, which text is extracted at
+    QSizeF dpi = QSizeF(72, 72);
+};
+
+// The requests for one loaded document
+struct TraceSession {
+    QString document;
+    int pageCount = 0;
+    QVector<TraceEntry> entries;
+};
+
+// Appends the requests made to the generator to a text file, one line
+// each, to replay them with qmupdf-replay. Can be used from several
+// threads.
+class Trace
+{
+public:
+    // Records nothing if fileName is empty
+    explicit Trace(const QString &fileName);
+
+    bool isEnabled() const;
+    // Starts the session of a newly loaded document
+    void begin(const QString &document, int pageCount);
+    // Time since begin(), to pass as the start of an entry
+    qint64 now() const;
+    // Fills in the lane of entry from the calling thread
+    void record(TraceEntry entry);
+
+    static bool read(const QString &fileName, QVector<TraceSession> *sessions);
+
+private:
+    Q_DISABLE_COPY(Trace)
+    void write(const QByteArray &line);
+
+    mutable std::mutex m_mutex;
+    QFile m_file;
+    QElapsedTimer m_timer;
+    QHash<Qt::HANDLE, int> m_lanes;
+};
+
+} // namespace QMuPDF
+
+#endif